@@ -0,0 +1,275 @@
+/* AdcAcquisition.cpp
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "Timer_PIT.h"
+#include "Timer_TPM.h"
+#include "AdcAcquisition.h"
+
+#define DMAMUX_SOURCE_ADC0 40
+#define SOPT7_TRGSEL_PIT1 5
+#define SOPT7_TRGSEL_TPM1 9
+
+//Init AdcAcquisition class variables
+bool AdcAcquisition::__adc_used = false;
+AdcAcquisition *AdcAcquisition::__obj = NULL;
+
+AdcAcquisition::AdcAcquisition(HardwareTimer *timebase, trigger_t trigger) :
+                    __timebase(timebase),
+                    __trigger(trigger),
+                    __running(false),
+                    __mode(3), //16-bit
+                    __buffer(NULL),
+                    __samples(0),
+                    __period(0),
+                    __trigger_hz(0),
+                    __timebase_hz(0),
+                    __start_tick(0),
+                    __filling(0),
+                    __blocks(0),
+                    __taken(0),
+                    __overruns(0),
+                    __late(false)
+                    {
+    if (__adc_used)
+        __valid = false;
+    else {
+        __valid = true;
+        __adc_used = true;
+        __obj = this;
+    }
+    __ready.samples = NULL;
+    __ready.count = 0;
+    __ready.index = 0;
+    __ready.tick = 0;
+    __ready.overrun = false;
+}
+
+AdcAcquisition::~AdcAcquisition() {
+    if (__valid) {
+        stop();
+        __valid = false;
+        __adc_used = false; //free the hardware resources
+        __obj = NULL;
+    }
+}
+
+bool AdcAcquisition::valid() {
+    return __valid;
+}
+
+void AdcAcquisition::attach(void (*fptr)(void)) {
+    __block_fptr.attach(fptr);
+}
+
+bool AdcAcquisition::setResolution(uint8_t bits) {
+    switch (bits) { //CFG1 MODE encoding is not in order of resolution
+        case 8:
+            __mode = 0;
+            return true;
+        case 12:
+            __mode = 1;
+            return true;
+        case 10:
+            __mode = 2;
+            return true;
+        case 16:
+            __mode = 3;
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool AdcAcquisition::start(uint8_t adc_channel, uint32_t sample_period, uint16_t *buffer, uint32_t samples_per_block) {
+    if (!__valid || buffer == NULL || samples_per_block == 0 || samples_per_block > MAX_SAMPLES_PER_BLOCK ||
+        sample_period == 0 || adc_channel > 23)
+        return false;
+    if (__trigger == tpm_trigger && sample_period > 0x10000) //TPM1 counter is 16 bits
+        return false;
+
+    if (__running)
+        stop();
+
+    __buffer = buffer;
+    __samples = samples_per_block;
+    __period = sample_period;
+    __trigger_hz = triggerHz();
+    __timebase_hz = (__timebase != NULL && __timebase->running()) ? __timebase->tickHz() : 0;
+    __filling = 0;
+    __blocks = 0;
+    __taken = 0;
+    __overruns = 0;
+    __late = false;
+
+    //Enable clocking of the modules involved
+    SIM->SCGC6 |= SIM_SCGC6_ADC0_MASK | SIM_SCGC6_DMAMUX_MASK;
+    SIM->SCGC7 |= SIM_SCGC7_DMA_MASK;
+    if (__trigger == pit_trigger)
+        SIM->SCGC6 |= SIM_SCGC6_PIT_MASK;
+    else
+        SIM->SCGC6 |= SIM_SCGC6_TPM1_MASK;
+
+    //ADC clock is the bus clock, divided down to the maximum rate for the resolution
+    uint32_t limit = (__mode == 3) ? 12000000 : 18000000;
+    uint32_t bus = Timer_PIT::moduleClockHz();
+    uint8_t adiv = 0;
+    while ((bus >> adiv) > limit && adiv < 3)
+        adiv++;
+    ADC0->CFG1 = ADC_CFG1_ADIV(adiv) | ADC_CFG1_MODE(__mode) | ADC_CFG1_ADICLK(0);
+    ADC0->CFG2 = 0;
+    ADC0->SC3 = 0; //single conversion per trigger, no averaging
+    ADC0->SC2 = ADC_SC2_ADTRG_MASK | ADC_SC2_DMAEN_MASK; //hardware trigger, DMA request on each result
+    ADC0->SC1[0] = ADC_SC1_ADCH(adc_channel); //wait for the trigger on this channel
+
+    //Route the trigger timer to ADC0 pre-trigger A
+    SIM->SOPT7 = SIM_SOPT7_ADC0ALTTRGEN_MASK |
+                 SIM_SOPT7_ADC0TRGSEL(__trigger == pit_trigger ? SOPT7_TRGSEL_PIT1 : SOPT7_TRGSEL_TPM1);
+
+    //DMA copies each 16-bit result into the buffer, one block at a time
+    DMAMUX0->CHCFG[ADC_ACQUISITION_DMA_CHANNEL] = 0;
+    DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
+    DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].SAR = (uint32_t) &ADC0->R[0];
+    __arm(0);
+    DMAMUX0->CHCFG[ADC_ACQUISITION_DMA_CHANNEL] = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(DMAMUX_SOURCE_ADC0);
+
+    NVIC_SetVector((IRQn_Type) (DMA0_IRQn + ADC_ACQUISITION_DMA_CHANNEL), (uint32_t) __dma_isr_wrapper);
+    NVIC_EnableIRQ((IRQn_Type) (DMA0_IRQn + ADC_ACQUISITION_DMA_CHANNEL));
+
+    //Prepare the trigger timer. The first trigger happens one period after it starts.
+    if (__trigger == pit_trigger) {
+        PIT->MCR &= ~PIT_MCR_MDIS_MASK; //Clearing MDIS bit enables the timer module. Channel 0 is unaffected.
+        PIT->CHANNEL[1].TCTRL = 0;
+        PIT->CHANNEL[1].LDVAL = sample_period - 1;
+    } else {
+        if ((SIM->SOPT2 & SIM_SOPT2_TPMSRC_MASK) == 0)
+            SIM->SOPT2 |= SIM_SOPT2_TPMSRC(1); //Set TPM global clock source: MCGFLLCLK, as Timer_TPM does
+        TPM1->SC = 0;
+        TPM1->CNT = 0;
+        TPM1->MOD = sample_period - 1;
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- the start tick anchors every block timestamp
+    __start_tick = (__timebase_hz != 0) ? __timebase->getTick64() : 0;
+    if (__trigger == pit_trigger)
+        PIT->CHANNEL[1].TCTRL = PIT_TCTRL_TEN_MASK; //No interrupt: the timeout only triggers the ADC
+    else
+        TPM1->SC = TPM_SC_CMOD(1) | TPM_SC_PS(0);
+    __running = true;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+
+    return true;
+}
+
+void AdcAcquisition::stop() {
+    if (!__valid || !__running)
+        return;
+
+    //Stop triggering first so that no conversion is left half-handled
+    if (__trigger == pit_trigger)
+        PIT->CHANNEL[1].TCTRL = 0;
+    else
+        TPM1->SC = 0;
+
+    NVIC_DisableIRQ((IRQn_Type) (DMA0_IRQn + ADC_ACQUISITION_DMA_CHANNEL));
+    DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].DCR = 0;
+    DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
+    DMAMUX0->CHCFG[ADC_ACQUISITION_DMA_CHANNEL] = 0;
+
+    ADC0->SC2 = 0;
+    ADC0->SC1[0] = ADC_SC1_ADCH(31); //ADCH = 31 disables the converter
+    SIM->SOPT7 = 0;
+
+    __running = false;
+}
+
+bool AdcAcquisition::running() {
+    return __running;
+}
+
+bool AdcAcquisition::getBlock(block_t *b) {
+    if (b == NULL)
+        return false;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- written by the DMA ISR
+    *b = __ready;
+    bool fresh = __blocks != __taken;
+    __taken = __blocks;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return fresh;
+}
+
+uint32_t AdcAcquisition::overruns() {
+    return __overruns;
+}
+
+uint32_t AdcAcquisition::triggerHz() {
+    return (__trigger == pit_trigger) ? Timer_PIT::moduleClockHz() : Timer_TPM::moduleClockHz();
+}
+
+void AdcAcquisition::__dma_isr() {
+    uint32_t dsr = DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].DSR_BCR;
+    DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK; //Clears DONE and any error flags
+    if (!(dsr & DMA_DSR_BCR_DONE_MASK))
+        return;
+
+    //Re-arm on the other half first. D_REQ stopped requests when this block completed, and the ADC holds its next
+    //result until the DMA reads it, so nothing is lost as long as this happens within one sample period.
+    uint8_t done = __filling;
+    __filling = done ^ 1;
+    __arm(__filling);
+
+    uint32_t index = __blocks;
+    uint64_t first = (uint64_t) index * __samples; //index of the first sample of the completed block
+    bool late = __late;
+
+    //The next block is missing its first sample if its second sample was already due when the DMA was re-armed
+    if (__timebase_hz != 0) {
+        uint64_t now = __timebase->getTick64();
+        __late = now > __start_tick + __to_timebase((first + __samples + 2) * __period);
+    } else
+        __late = false;
+    if (dsr & DMA_DSR_BCR_CE_MASK) //configuration error: the block is not trustworthy
+        late = true;
+    if (late)
+        __overruns++;
+
+    __ready.samples = __buffer + done * __samples;
+    __ready.count = __samples;
+    __ready.index = index;
+    __ready.tick = (__timebase_hz != 0) ? __start_tick + __to_timebase((first + 1) * __period) : 0;
+    __ready.overrun = late;
+    __blocks = index + 1;
+
+    __block_fptr.call();
+}
+
+void AdcAcquisition::__dma_isr_wrapper() {
+    __obj->__dma_isr();
+}
+
+void AdcAcquisition::__arm(uint8_t half) {
+    DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].DAR = (uint32_t) (__buffer + half * __samples);
+    DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_BCR(__samples * sizeof(uint16_t));
+    DMA0->DMA[ADC_ACQUISITION_DMA_CHANNEL].DCR = DMA_DCR_EINT_MASK | //interrupt when the block is complete
+                                                 DMA_DCR_ERQ_MASK | //transfer on ADC requests
+                                                 DMA_DCR_CS_MASK | //one transfer per request
+                                                 DMA_DCR_SSIZE(2) | //16-bit source, fixed address
+                                                 DMA_DCR_DINC_MASK | DMA_DCR_DSIZE(2) | //16-bit destination, incrementing
+                                                 DMA_DCR_D_REQ_MASK; //stop requests when the block is complete
+}
+
+uint64_t AdcAcquisition::__to_timebase(uint64_t trig_ticks) {
+    if (__trigger_hz == 0)
+        return 0;
+
+    //Split into whole seconds and a remainder so that the products cannot overflow
+    uint64_t sec = trig_ticks / __trigger_hz;
+    uint64_t rem = trig_ticks - sec * __trigger_hz;
+    return sec * __timebase_hz + (rem * __timebase_hz + __trigger_hz / 2) / __trigger_hz;
+}
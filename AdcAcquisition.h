@@ -0,0 +1,169 @@
+/* AdcAcquisition.h
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef ADCACQUISITION_H
+#define ADCACQUISITION_H
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+
+#ifndef ADC_ACQUISITION_DMA_CHANNEL
+#define ADC_ACQUISITION_DMA_CHANNEL 0 //DMA channel used to move ADC results, 0 to 3
+#endif
+
+/**
+ * Samples an ADC0 channel at a fixed rate with no CPU work per sample. A timer triggers each conversion in
+ * hardware (SIM_SOPT7 alternate trigger), and DMA moves each result into one half of a caller-supplied buffer
+ * while the other half is processed (ping-pong). The block-ready callback is called once per completed half.
+ *
+ * The trigger is PIT channel 1 or TPM1, so Timer_PIT (channel 0) and Timer_TPM (TPM0) remain free for timekeeping.
+ * Each block is timestamped on the getTick64() scale of a timebase HardwareTimer. The timestamp is computed from the
+ * trigger period rather than read in the ISR, so it has no interrupt jitter. It is exact when the timebase shares the
+ * trigger's clock, e.g. Timer_PIT with pit_trigger. Enable Timer_PIT before starting a pit_trigger acquisition,
+ * since Timer_PIT briefly disables the whole PIT module while it initializes.
+ *
+ * Only one AdcAcquisition object may be valid at a time (can control hardware). The caller is responsible for
+ * the pin muxing of the analog input.
+ */
+class AdcAcquisition {
+    public:
+        typedef enum {
+            pit_trigger, //PIT channel 1, clocked by the bus clock
+            tpm_trigger //TPM1 overflow, clocked by the TPM module clock. Periods up to 0x10000 ticks.
+        } trigger_t;
+
+        typedef struct {
+            const uint16_t *samples; //first sample of the block
+            uint32_t count; //number of samples
+            uint32_t index; //block sequence number since start()
+            uint64_t tick; //timebase tick at which the first sample was triggered
+            bool overrun; //the DMA was re-armed late, so samples at the start of this block may be missing
+        } block_t;
+
+        /**
+         * Constructs a new AdcAcquisition.
+         * @param timebase running timer whose getTick64() scale is used for block timestamps, or NULL for none
+         * @param trigger which timer triggers the conversions
+         */
+        AdcAcquisition(HardwareTimer *timebase, trigger_t trigger);
+
+        /**
+         * Destructs the AdcAcquisition. Acquisition is stopped and the hardware freed.
+         */
+        ~AdcAcquisition();
+
+        /**
+         * @returns true if this object can be used. If false, another AdcAcquisition object owns the hardware.
+         */
+        bool valid();
+
+        /**
+         * Sets the function called from the DMA ISR each time a block is complete. The block can be retrieved
+         * with getBlock(). The callback must finish with the block before the other half of the buffer fills up.
+         * @param fptr the user callback function
+         */
+        void attach(void (*fptr)(void));
+
+        /**
+         * Sets the method called from the DMA ISR each time a block is complete. See attach() above.
+         * @param tptr the object
+         * @param mptr method to call on the object
+         */
+        template<typename T> void attach(T *tptr, void (T::*mptr)(void));
+
+        /**
+         * Sets the ADC resolution for the next start(). Higher resolutions convert more slowly.
+         * @param bits 8, 10, 12 or 16 (default)
+         * @returns true if bits is supported.
+         */
+        bool setResolution(uint8_t bits);
+
+        /**
+         * Starts acquisition.
+         * @param adc_channel ADC0 input channel (ADCH), 0 to 23
+         * @param sample_period ticks of the trigger clock (see triggerHz()) between samples. Must be longer than
+         * the ADC conversion time.
+         * @param buffer storage for two blocks, i.e. 2 * samples_per_block samples
+         * @param samples_per_block number of samples per block, 1 to MAX_SAMPLES_PER_BLOCK
+         * @returns true if acquisition started.
+         */
+        bool start(uint8_t adc_channel, uint32_t sample_period, uint16_t *buffer, uint32_t samples_per_block);
+
+        /**
+         * Stops acquisition. A partially filled block is discarded.
+         */
+        void stop();
+
+        /**
+         * @returns true if acquisition is running.
+         */
+        bool running();
+
+        /**
+         * Retrieves the most recently completed block.
+         * @param b receives the block description
+         * @returns true if a block has completed since the previous call.
+         */
+        bool getBlock(block_t *b);
+
+        /**
+         * @returns the number of blocks that may be missing samples because the DMA was re-armed late.
+         */
+        uint32_t overruns();
+
+        /**
+         * @returns the frequency of the trigger clock, read from the live clock configuration.
+         */
+        uint32_t triggerHz();
+
+        const static uint32_t MAX_SAMPLES_PER_BLOCK = 0x7FFFF; //DMA byte count limit
+
+    private:
+        void __dma_isr();
+
+        /**
+         * We need a static function to use as interrupt service routine.
+         */
+        static void __dma_isr_wrapper();
+
+        /**
+         * Arms the DMA channel to fill one half of the buffer.
+         */
+        void __arm(uint8_t half);
+
+        /**
+         * @returns trig_ticks trigger clock ticks converted to timebase ticks
+         */
+        uint64_t __to_timebase(uint64_t trig_ticks);
+
+        HardwareTimer *__timebase;
+        trigger_t __trigger;
+        bool __valid;
+        bool __running;
+        uint8_t __mode; //ADC CFG1 MODE for the selected resolution
+        uint16_t *__buffer;
+        uint32_t __samples; //per block
+        uint32_t __period; //trigger ticks per sample
+        uint32_t __trigger_hz;
+        uint32_t __timebase_hz;
+        uint64_t __start_tick; //timebase tick at which the trigger was started
+        volatile uint8_t __filling; //half of the buffer the DMA is filling
+        volatile uint32_t __blocks; //blocks completed
+        volatile uint32_t __taken; //value of __blocks at the last getBlock()
+        volatile uint32_t __overruns;
+        volatile bool __late; //the block now filling may be missing samples
+        block_t __ready; //most recently completed block
+        FunctionPointer __block_fptr; //User block-ready callback
+
+        static bool __adc_used; //This flag ensures that no two AdcAcquisition objects attempt to manipulate the hardware at once
+        static AdcAcquisition *__obj; //if __adc_used is true, this should point to the valid object. This helps with the ISR wrapper.
+};
+
+template <typename T> void AdcAcquisition::attach(T *tptr, void (T::*mptr)(void)) {
+    if (tptr != NULL && mptr != NULL)
+        __block_fptr.attach(tptr, mptr);
+}
+
+#endif
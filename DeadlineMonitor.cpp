@@ -0,0 +1,215 @@
+/* DeadlineMonitor.cpp
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "DeadlineMonitor.h"
+
+DeadlineMonitor::DeadlineMonitor(HardwareTimer *timer) :
+                    __timer(timer),
+                    __armed(0),
+                    __free(0),
+                    __overruns(0)
+                    {
+    for (uint16_t i = 0; i < DEADLINE_MONITOR_POOL_SIZE; i++) {
+        __watches[i].state = FREE;
+        __watches[i].gen = 0;
+        __watches[i].next = (i + 1 < DEADLINE_MONITOR_POOL_SIZE) ? i + 1 : NONE;
+    }
+}
+
+DeadlineMonitor::~DeadlineMonitor() {
+    stop();
+}
+
+bool DeadlineMonitor::start(uint32_t check_period) {
+    if (__timer == NULL || !__timer->valid())
+        return false;
+
+    __timer->enable(this, &DeadlineMonitor::__check);
+    __timer->start(check_period, true, 0);
+    return __timer->running();
+}
+
+void DeadlineMonitor::stop() {
+    if (__timer != NULL)
+        __timer->disable();
+}
+
+int32_t DeadlineMonitor::arm(uint16_t site, uint32_t budget) {
+    uint32_t deadline = __timer->getTick() + budget;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- the timer callback walks the same lists
+
+    uint16_t idx = __free;
+    if (idx == NONE) {
+        __set_PRIMASK(primask);
+        return -1;
+    }
+    __free = __watches[idx].next;
+
+    __watch_t *w = &__watches[idx];
+    w->deadline = deadline;
+    w->site = site;
+    w->state = ARMED;
+    __place(__armed, idx);
+    __sift_up(__armed++);
+    int32_t handle = ((int32_t) w->gen << 16) | idx;
+
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return handle;
+}
+
+bool DeadlineMonitor::disarm(int32_t handle) {
+    uint32_t now = __timer->getTick();
+
+    uint16_t idx = (uint16_t) (handle & 0xFFFF);
+    if (handle < 0 || idx >= DEADLINE_MONITOR_POOL_SIZE)
+        return false;
+
+    __watch_t *w = &__watches[idx];
+    bool on_time = false;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+
+    if (w->gen != (uint16_t) (handle >> 16)) { //watch was freed and reused since this handle was issued
+        __set_PRIMASK(primask);
+        return false;
+    }
+
+    if (w->state == ARMED) {
+        __remove(w->pos);
+        on_time = true;
+    } else if (w->state == EXPIRED) {
+        if (__overruns - w->seq <= DEADLINE_MONITOR_LOG_SIZE) { //record not yet overwritten: fill in the final overrun
+            overrun_t *rec = &__log[w->seq & (DEADLINE_MONITOR_LOG_SIZE - 1)];
+            rec->overrun = now - w->deadline;
+            rec->ended = true;
+        }
+    } else { //already free
+        __set_PRIMASK(primask);
+        return false;
+    }
+
+    w->state = FREE;
+    w->gen = (w->gen + 1) & 0x7FFF; //keeps handles non-negative
+    w->next = __free;
+    __free = idx;
+
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return on_time;
+}
+
+uint32_t DeadlineMonitor::overrunCount() {
+    return __overruns;
+}
+
+bool DeadlineMonitor::getOverrun(uint32_t age, overrun_t *record) {
+    if (record == NULL)
+        return false;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+
+    bool found = age < __overruns && age < DEADLINE_MONITOR_LOG_SIZE;
+    if (found)
+        *record = __log[(__overruns - 1 - age) & (DEADLINE_MONITOR_LOG_SIZE - 1)];
+
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return found;
+}
+
+void DeadlineMonitor::__check() {
+    //Runs in the timer ISR, so the lists cannot change underneath us.
+    uint32_t now = __timer->getTick();
+    uint32_t pc = 0;
+    bool have_pc = false;
+
+    while (__armed > 0 && (int32_t) (now - __watches[__heap[0]].deadline) >= 0) {
+        __watch_t *w = &__watches[__heap[0]];
+        __remove(0);
+
+        if (!have_pc) {
+            pc = __interrupted_pc();
+            have_pc = true;
+        }
+
+        w->state = EXPIRED;
+        w->seq = __overruns;
+        overrun_t *rec = &__log[w->seq & (DEADLINE_MONITOR_LOG_SIZE - 1)];
+        rec->site = w->site;
+        rec->ended = false;
+        rec->overrun = now - w->deadline;
+        rec->pc = pc;
+        __overruns++;
+    }
+}
+
+void DeadlineMonitor::__remove(uint16_t pos) {
+    //Fill the hole with the last watch, which may belong either above or below it
+    __armed--;
+    if (pos == __armed)
+        return;
+    __place(pos, __heap[__armed]);
+    if (pos > 0 && __earlier(pos, (pos - 1) / 2))
+        __sift_up(pos);
+    else
+        __sift_down(pos);
+}
+
+void DeadlineMonitor::__sift_up(uint16_t pos) {
+    while (pos > 0) {
+        uint16_t parent = (pos - 1) / 2;
+        if (!__earlier(pos, parent))
+            break;
+        uint16_t idx = __heap[pos];
+        __place(pos, __heap[parent]);
+        __place(parent, idx);
+        pos = parent;
+    }
+}
+
+void DeadlineMonitor::__sift_down(uint16_t pos) {
+    for (;;) {
+        uint32_t child = 2 * (uint32_t) pos + 1;
+        if (child >= __armed)
+            break;
+        if (child + 1 < __armed && __earlier(child + 1, child))
+            child++;
+        if (!__earlier(child, pos))
+            break;
+        uint16_t idx = __heap[pos];
+        __place(pos, __heap[child]);
+        __place(child, idx);
+        pos = child;
+    }
+}
+
+bool DeadlineMonitor::__earlier(uint16_t a, uint16_t b) {
+    //Deadlines wrap around, so compare their difference. Armed deadlines are always within 2^31 ticks of each other.
+    return (int32_t) (__watches[__heap[a]].deadline - __watches[__heap[b]].deadline) < 0;
+}
+
+void DeadlineMonitor::__place(uint16_t pos, uint16_t idx) {
+    __heap[pos] = idx;
+    __watches[idx].pos = pos;
+}
+
+uint32_t DeadlineMonitor::__interrupted_pc() {
+    //On exception entry the hardware pushes {r0-r3, r12, lr, pc, xpsr} and loads lr with an EXC_RETURN value.
+    //The first function in the handler chain to save lr pushes it as the highest word of its prologue, directly
+    //below the hardware frame. Search upwards from the current (main) stack pointer for it.
+    uint32_t *sp = (uint32_t *) __get_MSP();
+    for (uint8_t i = 0; i < 128; i++) {
+        uint32_t v = sp[i];
+        if (v == 0xFFFFFFF1 || v == 0xFFFFFFF9 || v == 0xFFFFFFFD) {
+            uint32_t *frame = (v & 0x4) ? (uint32_t *) __get_PSP() : &sp[i+1]; //bit 2 set: thread was using the process stack
+            return frame[6];
+        }
+    }
+    return 0;
+}
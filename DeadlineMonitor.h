@@ -0,0 +1,146 @@
+/* DeadlineMonitor.h
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef DEADLINEMONITOR_H
+#define DEADLINEMONITOR_H
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+
+#ifndef DEADLINE_MONITOR_POOL_SIZE
+#define DEADLINE_MONITOR_POOL_SIZE 256 //maximum number of concurrently armed watches
+#endif
+
+#ifndef DEADLINE_MONITOR_LOG_SIZE
+#define DEADLINE_MONITOR_LOG_SIZE 16 //number of overrun records kept. Must be a power of two.
+#endif
+
+/**
+ * Watches code sections against a time budget. A section is armed with a budget before it starts and disarmed
+ * when it ends. If the budget expires first, the periodic check on the HardwareTimer records the site ID,
+ * how far past the deadline the section ran, and the program counter that was interrupted. Unlike the COP
+ * watchdog, nothing is reset or halted; overruns are only logged for later inspection.
+ */
+class DeadlineMonitor {
+    public:
+        typedef struct {
+            uint16_t site; //site ID passed to arm()
+            bool ended; //if true, the section has ended and overrun is final. Otherwise it was still running.
+            uint32_t overrun; //ticks past the deadline
+            uint32_t pc; //program counter interrupted when the overrun was detected, or 0 if unknown
+        } overrun_t;
+
+        /**
+         * Constructs a new DeadlineMonitor.
+         * @param timer the timer used as time base and to check deadlines. The monitor takes over its callback.
+         */
+        DeadlineMonitor(HardwareTimer *timer);
+
+        /**
+         * Destructs the DeadlineMonitor. The timer is disabled.
+         */
+        ~DeadlineMonitor();
+
+        /**
+         * Enables and starts the timer.
+         * @param check_period how often to check for expired deadlines, in timer ticks. Overruns are
+         * detected at most this late.
+         * @returns true on success, false if the timer could not be started.
+         */
+        bool start(uint32_t check_period);
+
+        /**
+         * Stops checking deadlines and disables the timer.
+         */
+        void stop();
+
+        /**
+         * Starts watching a code section. This is safe to call from an interrupt service routine, and takes
+         * O(log n) time in the number of armed watches.
+         * @param site caller-chosen ID identifying the code section
+         * @param budget number of timer ticks the section may take
+         * @returns a handle to pass to disarm(), or -1 if the watch pool is exhausted.
+         */
+        int32_t arm(uint16_t site, uint32_t budget);
+
+        /**
+         * Stops watching a code section. This is safe to call from an interrupt service routine.
+         * Each handle is only valid once: a stale handle whose watch has since been reused is rejected.
+         * @param handle value returned by arm()
+         * @returns true if the section ended within its budget, false if it overran or handle is invalid.
+         */
+        bool disarm(int32_t handle);
+
+        /**
+         * @returns the total number of overruns detected since construction.
+         */
+        uint32_t overrunCount();
+
+        /**
+         * Retrieves a logged overrun. Only the most recent DEADLINE_MONITOR_LOG_SIZE records are kept.
+         * @param age 0 for the most recent overrun, 1 for the one before, and so on
+         * @param record receives a copy of the overrun
+         * @returns true if record was filled in, false if no such record is kept.
+         */
+        bool getOverrun(uint32_t age, overrun_t *record);
+
+    private:
+        typedef struct {
+            uint32_t deadline; //tick at which the budget expires
+            uint32_t seq; //overrun sequence number, if expired
+            uint16_t site;
+            uint16_t pos; //position in the heap, if armed
+            uint16_t next; //free list link
+            uint16_t gen; //incremented each time the watch is freed, so that stale handles can be told apart
+            uint8_t state;
+        } __watch_t;
+
+        /**
+         * Timer callback. Moves expired watches from the heap into the overrun log.
+         */
+        void __check();
+
+        /**
+         * Removes the watch at a heap position. Must be called with interrupts disabled.
+         */
+        void __remove(uint16_t pos);
+
+        /**
+         * Moves the watch at a heap position up or down until the heap is ordered again.
+         */
+        void __sift_up(uint16_t pos);
+        void __sift_down(uint16_t pos);
+
+        /**
+         * @returns true if heap position a has an earlier deadline than heap position b.
+         */
+        bool __earlier(uint16_t a, uint16_t b);
+
+        /**
+         * Puts a watch at a heap position.
+         */
+        void __place(uint16_t pos, uint16_t idx);
+
+        /**
+         * @returns the program counter that was interrupted by the current exception, or 0 if it cannot be found.
+         */
+        static uint32_t __interrupted_pc();
+
+        HardwareTimer *__timer;
+        __watch_t __watches[DEADLINE_MONITOR_POOL_SIZE];
+        uint16_t __heap[DEADLINE_MONITOR_POOL_SIZE]; //armed watches as a binary min-heap on deadline, so arm() and
+                                                     //disarm() stay O(log n) inside their critical sections
+        uint16_t __armed; //number of watches in the heap
+        uint16_t __free; //first unused watch
+        overrun_t __log[DEADLINE_MONITOR_LOG_SIZE];
+        volatile uint32_t __overruns; //total number of overruns, also the next sequence number
+
+        const static uint16_t NONE = 0xFFFF;
+        const static uint8_t FREE = 0;
+        const static uint8_t ARMED = 1;
+        const static uint8_t EXPIRED = 2;
+};
+
+#endif
@@ -0,0 +1,265 @@
+/* DisciplinedClock.cpp
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "PreciseTime.h"
+#include "DisciplinedClock.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+DisciplinedClock::DisciplinedClock(HardwareTimer *timer) :
+                    __timer(timer),
+                    __state(unsynced),
+                    __hz(0),
+                    __nominal(0),
+                    __scale(0),
+                    __slewScale(0),
+                    __slewEnd(0),
+                    __anchorTick(0),
+                    __anchorNs(0),
+                    __lastTick(0),
+                    __seconds(0),
+                    __label(0),
+                    __labelled(false),
+                    __drift(0),
+                    __estimate(0),
+                    __adjust(0),
+                    __offset(0),
+                    __maxOffset(0),
+                    __inside(0),
+                    __pulses(0),
+                    __missed(0),
+                    __holdovers(0)
+                    {
+}
+
+void DisciplinedClock::reset() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- pulse() may run from an ISR
+    __state = unsynced;
+    __scale = 0;
+    __labelled = false;
+    __drift = 0;
+    __estimate = 0;
+    __adjust = 0;
+    __offset = 0;
+    __maxOffset = 0;
+    __inside = 0;
+    __pulses = 0;
+    __missed = 0;
+    __holdovers = 0;
+    __init_scale();
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void DisciplinedClock::pulse(uint64_t tick) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- readers must not see a half-updated anchor
+
+    if (!__init_scale()) {
+        __set_PRIMASK(primask);
+        return;
+    }
+
+    //The correction takes effect from now rather than from the pulse, so that time already read stays read
+    uint64_t now = __timer->getTick64();
+    if (now < tick)
+        now = tick;
+    uint64_t local = __ns_at(tick);
+
+    if (__pulses == 0) { //first pulse: step forward to the next whole second
+        __seconds = (local + NS_PER_SEC - 1) / NS_PER_SEC;
+        if (__labelled && __label > __seconds)
+            __seconds = __label;
+        __labelled = false;
+        __anchorNs = __seconds * NS_PER_SEC + __mul_q32(now - tick, __scale);
+        __anchorTick = now;
+        __slewEnd = now;
+        __lastTick = tick;
+        __pulses = 1;
+        __state = acquiring;
+        __set_PRIMASK(primask);
+        return;
+    }
+
+    //Number of seconds since the last pulse, more than one if pulses were missed
+    uint64_t interval = tick - __lastTick;
+    uint64_t n = (__mul_q32(interval, __scale) + NS_PER_SEC / 2) / NS_PER_SEC;
+    if (tick <= __lastTick || n == 0) { //glitch
+        __set_PRIMASK(primask);
+        return;
+    }
+
+    if (__pulses == 1 && interval < 0x100000000ULL) { //the first interval gives the oscillator frequency directly
+        uint64_t num = n * NS_PER_SEC;
+        uint64_t q = num / interval;
+        uint64_t r = num - q * interval;
+        __nominal = (q << 32) + (r << 32) / interval;
+        __estimate = (int32_t) (((int64_t) (n * __hz) - (int64_t) interval) * (int64_t) NS_PER_SEC / (int64_t) interval);
+    }
+
+    if (n > 1 && __state == locked)
+        __holdovers++;
+    __missed += (uint32_t) (n - 1);
+    __seconds += n;
+    int64_t offset = (int64_t) (local - __seconds * NS_PER_SEC); //at most half a second either way
+
+    uint64_t step = 0;
+    if (__labelled && __label > __seconds) {
+        step = (__label - __seconds) * NS_PER_SEC;
+        __seconds = __label;
+    }
+    __labelled = false;
+
+    //PI servo. The integral term is the frequency correction: the offset accumulated over n seconds, so the
+    //frequency error is offset / n ppb. It stays in force until the next pulse, and through holdover.
+    __drift += (int64_t) KI_Q16 * (offset / (int64_t) n);
+    if (__drift > ((int64_t) MAX_PPB << 16))
+        __drift = (int64_t) MAX_PPB << 16;
+    if (__drift < -((int64_t) MAX_PPB << 16))
+        __drift = -((int64_t) MAX_PPB << 16);
+    int64_t freq = -(__drift >> 16);
+    __adjust = (int32_t) freq;
+
+    //The proportional term is a phase correction: KP * offset ns, slewed out over the next second only, so it
+    //cannot turn into a frequency error if the pulses stop. An offset of x ns over one second is x ppb.
+    int64_t slew = freq - (((int64_t) KP_Q16 * offset) >> 16);
+    if (slew > MAX_PPB)
+        slew = MAX_PPB;
+    if (slew < -MAX_PPB)
+        slew = -MAX_PPB;
+
+    //Re-anchor at the current time, then apply the new rates from here on
+    __anchorNs = __ns_at(now) + step;
+    __anchorTick = now;
+    __scale = __apply_ppb(freq);
+    __slewScale = __apply_ppb(slew);
+    __slewEnd = now + interval / n; //one second of ticks, as just measured
+
+    __lastTick = tick;
+    __pulses++;
+    __offset = (int32_t) offset;
+
+    uint32_t mag = (uint32_t) (offset < 0 ? -offset : offset);
+    if (mag <= LOCK_THRESHOLD_NS) {
+        if (__inside < LOCK_PULSES)
+            __inside++;
+    } else
+        __inside = 0;
+
+    if (__state != locked && __inside >= LOCK_PULSES) {
+        __state = locked;
+        __maxOffset = mag;
+    } else if (__state == locked) {
+        if (mag > __maxOffset)
+            __maxOffset = mag;
+        if (mag > UNLOCK_THRESHOLD_NS) {
+            __state = acquiring;
+            __inside = 0;
+        }
+    }
+
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void DisciplinedClock::ppsEdge() {
+    if (__timer != NULL)
+        pulse(__timer->getTick64());
+}
+
+bool DisciplinedClock::setNextSecond(uint64_t seconds) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    bool ok = __init_scale() && seconds * NS_PER_SEC >= __ns_at(__timer->getTick64()) &&
+              (__pulses == 0 || seconds > __seconds);
+    if (ok) {
+        __label = seconds;
+        __labelled = true;
+    }
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return ok;
+}
+
+uint64_t DisciplinedClock::getNs() {
+    if (__timer == NULL)
+        return 0;
+    return toNs(__timer->getTick64());
+}
+
+uint64_t DisciplinedClock::toNs(uint64_t tick) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    uint64_t ns = __init_scale() ? __ns_at(tick) : 0;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return ns;
+}
+
+PreciseTime DisciplinedClock::getTime() {
+    return PreciseTime::from_ns64(getNs());
+}
+
+void DisciplinedClock::getStatus(status_t *s) {
+    if (s == NULL)
+        return;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    s->state = __state;
+    s->pulses = __pulses;
+    s->missed = __missed;
+    s->holdovers = __holdovers;
+    s->offset = __offset;
+    s->maxOffset = __maxOffset;
+    s->freq = __estimate + __adjust;
+    s->sincePulse = 0;
+    if (__pulses > 0 && __init_scale())
+        s->sincePulse = __ns_at(__timer->getTick64()) - __ns_at(__lastTick);
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+
+    if (s->state == locked && s->sincePulse > HOLDOVER_NS)
+        s->state = holdover;
+}
+
+bool DisciplinedClock::__init_scale() {
+    if (__scale != 0)
+        return true;
+    if (__timer == NULL || __timer->tickHz() == 0)
+        return false;
+
+    __hz = __timer->tickHz();
+    __nominal = (NS_PER_SEC << 32) / __hz;
+    __scale = __nominal;
+    __slewScale = __nominal;
+    __anchorTick = __timer->getTick64();
+    __slewEnd = __anchorTick;
+    __anchorNs = __timer->getElapsedNs();
+    return true;
+}
+
+uint64_t DisciplinedClock::__ns_at(uint64_t tick) {
+    if (tick >= __anchorTick) {
+        if (tick <= __slewEnd)
+            return __anchorNs + __mul_q32(tick - __anchorTick, __slewScale);
+        return __anchorNs + __mul_q32(__slewEnd - __anchorTick, __slewScale) + __mul_q32(tick - __slewEnd, __scale);
+    }
+
+    uint64_t back = __mul_q32(__anchorTick - tick, __scale);
+    return back < __anchorNs ? __anchorNs - back : 0;
+}
+
+uint64_t DisciplinedClock::__apply_ppb(int64_t ppb) {
+    uint64_t ppb_q32 = ((uint64_t) (ppb < 0 ? -ppb : ppb) << 32) / NS_PER_SEC;
+    uint64_t corr = __mul_q32(__nominal, ppb_q32);
+    return ppb < 0 ? __nominal - corr : __nominal + corr;
+}
+
+uint64_t DisciplinedClock::__mul_q32(uint64_t a, uint64_t b) {
+    uint64_t ah = a >> 32;
+    uint64_t al = a & 0xFFFFFFFF;
+    uint64_t bh = b >> 32;
+    uint64_t bl = b & 0xFFFFFFFF;
+    return ((ah * bh) << 32) + ah * bl + al * bh + ((al * bl) >> 32);
+}
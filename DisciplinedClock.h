@@ -0,0 +1,157 @@
+/* DisciplinedClock.h
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef DISCIPLINEDCLOCK_H
+#define DISCIPLINEDCLOCK_H
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "PreciseTime.h"
+
+/**
+ * Disciplines the tick-to-time conversion of a HardwareTimer to an external 1PPS signal, e.g. from a GPS receiver.
+ * Each pulse is timestamped in timer ticks and compared with the whole second it marks. A fixed-point PI loop
+ * estimates the phase and frequency error of the timer oscillator and corrects the number of nanoseconds per tick.
+ * The integral term corrects the frequency until the next pulse; the proportional term removes part of the phase
+ * error by slewing over the following second only. Apart from a single forward step at the first pulse, the
+ * disciplined time never jumps, and it never runs backwards. When the pulses stop, the last frequency correction is
+ * kept (holdover) and the phase slew ends on time, so holdover drifts only by the residual frequency error.
+ *
+ * The best timestamps come from hardware input capture, e.g. with a Timer_TPM capture callback:
+ *     clock.pulse(tpm.getCaptureTick(channel));
+ * Otherwise, call ppsEdge() from the pulse interrupt, at the cost of the interrupt latency.
+ *
+ * The timer must stay running. If its clock is reconfigured (HardwareTimer::clockChanged()), call reset().
+ */
+class DisciplinedClock {
+    public:
+        typedef enum {
+            unsynced, //no pulse yet; time runs at the nominal tick rate
+            acquiring, //pulses are arriving but the phase error is still large
+            locked, //phase error within LOCK_THRESHOLD_NS for LOCK_PULSES pulses
+            holdover //was locked, but no pulse for more than HOLDOVER_NS
+        } state_t;
+
+        typedef struct {
+            state_t state;
+            uint32_t pulses; //pulses accepted
+            uint32_t missed; //pulses missing between accepted ones
+            uint32_t holdovers; //times the pulse was lost while locked
+            int32_t offset; //phase error at the last pulse, ns. Positive if the clock was ahead.
+            uint32_t maxOffset; //largest phase error magnitude since locking, ns
+            int32_t freq; //total frequency correction relative to the nominal tick rate, ppb, without the phase slew
+            uint64_t sincePulse; //time since the last pulse, ns
+        } status_t;
+
+        /**
+         * Constructs a new DisciplinedClock.
+         * @param timer the running timer used as time base. Its callback is not used.
+         */
+        DisciplinedClock(HardwareTimer *timer);
+
+        /**
+         * Forgets all pulses and the frequency estimate. Disciplined time restarts from the timer's elapsed time.
+         */
+        void reset();
+
+        /**
+         * Feeds one pulse to the servo. This is safe to call from an interrupt service routine.
+         * Pulses that arrive less than half a second after the previous one are ignored as glitches.
+         * @param tick timer tick, on the HardwareTimer::getTick64() scale, at which the pulse edge occurred
+         */
+        void pulse(uint64_t tick);
+
+        /**
+         * Feeds a pulse timestamped now. Intended to be attached directly to the pulse pin interrupt.
+         */
+        void ppsEdge();
+
+        /**
+         * Sets the second number of the next pulse, e.g. from the time of day reported by the GPS receiver.
+         * Without this, the first pulse is labelled with the next whole second of the timer's elapsed time and each
+         * later pulse with the following second. A label ahead of the running count steps time forward at that pulse.
+         * @param seconds second number of the next pulse
+         * @returns true if accepted, false if the label would step time backwards.
+         */
+        bool setNextSecond(uint64_t seconds);
+
+        /**
+         * @returns the disciplined time in nanoseconds.
+         */
+        uint64_t getNs();
+
+        /**
+         * Converts a timer tick to disciplined time, e.g. to timestamp an input capture.
+         * @param tick timer tick on the HardwareTimer::getTick64() scale
+         * @returns the disciplined time at tick in nanoseconds
+         */
+        uint64_t toNs(uint64_t tick);
+
+        /**
+         * @returns the disciplined time in PreciseTime form.
+         */
+        PreciseTime getTime();
+
+        /**
+         * @param s receives the servo state and holdover statistics
+         */
+        void getStatus(status_t *s);
+
+        const static uint32_t LOCK_THRESHOLD_NS = 2000;
+        const static uint8_t LOCK_PULSES = 4;
+        const static uint32_t UNLOCK_THRESHOLD_NS = 100000;
+        const static uint64_t HOLDOVER_NS = 1500000000ULL;
+        const static int32_t MAX_PPB = 500000; //slew rate limit
+
+    private:
+        /**
+         * Sets the nominal scale from the timer tick rate if not done yet.
+         * @returns false if the timer tick rate is not known yet.
+         */
+        bool __init_scale();
+
+        /**
+         * @returns the disciplined time at tick. Must be called with interrupts disabled.
+         */
+        uint64_t __ns_at(uint64_t tick);
+
+        /**
+         * @returns __nominal corrected by ppb parts per billion, 32.32 fixed point
+         */
+        uint64_t __apply_ppb(int64_t ppb);
+
+        /**
+         * @returns (a * b) >> 32 without intermediate overflow, provided the result fits in 64 bits.
+         */
+        static uint64_t __mul_q32(uint64_t a, uint64_t b);
+
+        HardwareTimer *__timer;
+        state_t __state;
+        uint32_t __hz; //nominal timer tick rate
+        uint64_t __nominal; //estimated ns per tick without PI correction, 32.32 fixed point
+        uint64_t __scale; //ns per tick with the frequency correction, 32.32 fixed point
+        uint64_t __slewScale; //ns per tick while the phase correction is slewed out, 32.32 fixed point
+        uint64_t __slewEnd; //tick at which the phase slew ends and __scale applies again
+        uint64_t __anchorTick; //tick at which __anchorNs was valid
+        uint64_t __anchorNs; //disciplined time at __anchorTick
+        uint64_t __lastTick; //tick of the last accepted pulse
+        uint64_t __seconds; //second number of the last accepted pulse
+        uint64_t __label; //second number of the next pulse, if __labelled
+        bool __labelled;
+        int64_t __drift; //integral term, ppb with 16 fractional bits
+        int32_t __estimate; //frequency error estimated from the first interval, ppb
+        int32_t __adjust; //frequency correction (integral term) currently applied, ppb
+        int32_t __offset;
+        uint32_t __maxOffset;
+        uint8_t __inside; //consecutive pulses within LOCK_THRESHOLD_NS
+        uint32_t __pulses;
+        uint32_t __missed;
+        uint32_t __holdovers;
+
+        const static int32_t KP_Q16 = 45875; //proportional gain 0.7
+        const static int32_t KI_Q16 = 19661; //integral gain 0.3
+};
+
+#endif
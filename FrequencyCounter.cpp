@@ -0,0 +1,159 @@
+/* FrequencyCounter.cpp
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "Timer_TPM.h"
+#include "FrequencyCounter.h"
+
+FrequencyCounter::FrequencyCounter(Timer_TPM *counter, HardwareTimer *gate, uint8_t capture_channel, uint8_t clkin) :
+                    __counter(counter),
+                    __gate(gate),
+                    __channel(capture_channel),
+                    __clkin(clkin),
+                    __gate_period(0),
+                    __gate_hz(0),
+                    __ref_hz(0),
+                    __crossover(DEFAULT_CROSSOVER_HZ),
+                    __reciprocal(false),
+                    __primed(false),
+                    __started(false),
+                    __last_count(0),
+                    __edges(0),
+                    __first(0),
+                    __last(0)
+                    {
+    __result.hz = 0;
+    __result.resolution = 0;
+    __result.reciprocal = false;
+    __result.valid = false;
+}
+
+FrequencyCounter::~FrequencyCounter() {
+    stop();
+}
+
+bool FrequencyCounter::start(uint32_t gate_period) {
+    if (__counter == NULL || __gate == NULL || !__counter->valid() || !__gate->valid() || gate_period == 0)
+        return false;
+
+    __gate_period = gate_period;
+    __result.valid = false;
+
+    __started = true; //from here on the hardware is clocked and stop() has something to undo
+    __counter->enable((void (*)(void)) NULL);
+    __set_mode(false); //gated counting is safe at any frequency, so start there
+
+    __gate->enable(this, &FrequencyCounter::__gate_isr);
+    __gate_hz = __gate->tickHz(); //read from the clock configuration by enable()
+    __ref_hz = __counter->tickHz();
+    __gate->start(gate_period, true, 0);
+    return __counter->running() && __gate->running();
+}
+
+void FrequencyCounter::stop() {
+    if (!__started) //never started: the timers may not even be clocked, and touching them would fault
+        return;
+    
+    __gate->disable();
+    __counter->stopChannel(__channel);
+    __counter->setClockSource(Timer_TPM::internal_clock, __clkin);
+    __counter->disable();
+    __started = false;
+}
+
+void FrequencyCounter::setCrossover(uint32_t hz) {
+    __crossover = hz;
+}
+
+bool FrequencyCounter::getMeasurement(measurement_t *m) {
+    if (m == NULL)
+        return false;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- written by the gate ISR
+    *m = __result;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return m->valid;
+}
+
+void FrequencyCounter::__gate_isr() {
+    if (__reciprocal) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq(); //CRITICAL SECTION -- captures may arrive from the TPM ISR
+        uint32_t edges = __edges;
+        uint64_t first = __first;
+        uint64_t last = __last;
+        if (edges >= 2) { //next window starts at the last edge, so no period is lost
+            __first = last;
+            __edges = 1;
+        }
+        __set_PRIMASK(primask); //END CRITICAL SECTION
+
+        if (edges < 2) //slower than the gate window: keep accumulating
+            return;
+
+        uint64_t span = last - first;
+        uint64_t hz = __ratio_q16((uint64_t) (edges - 1) * __ref_hz, span);
+        __result.hz = hz;
+        __result.resolution = hz / span; //one reference tick out of span
+        __result.reciprocal = true;
+        __result.valid = true;
+
+        if (hz >= ((uint64_t) __crossover << 16))
+            __set_mode(false);
+    } else {
+        //getTick64() counts an overflow that is pending behind this ISR, so the count never drops by a whole period.
+        //Still, a window that appears to run backwards is discarded rather than reported as a huge frequency.
+        uint64_t count = __counter->getTick64();
+        if (__primed && count >= __last_count) {
+            uint64_t hz = __ratio_q16((count - __last_count) * __gate_hz, __gate_period);
+            __result.hz = hz;
+            __result.resolution = __ratio_q16(__gate_hz, __gate_period); //one edge per gate window
+            __result.reciprocal = false;
+            __result.valid = true;
+
+            if (hz < ((uint64_t) __crossover << 15)) {
+                __set_mode(true);
+                return;
+            }
+        }
+        __last_count = count;
+        __primed = true;
+    }
+}
+
+void FrequencyCounter::__capture_isr() {
+    uint64_t tick = __counter->getCaptureTick(__channel);
+    if (__edges == 0)
+        __first = tick;
+    __last = tick;
+    __edges++;
+}
+
+void FrequencyCounter::__set_mode(bool reciprocal) {
+    __reciprocal = reciprocal;
+    __primed = false;
+    __edges = 0;
+
+    if (reciprocal) { //timestamp signal edges against the internal clock
+        __counter->setClockSource(Timer_TPM::internal_clock, __clkin);
+        __counter->enableCapture(__channel, Timer_TPM::rising, this, &FrequencyCounter::__capture_isr);
+    } else { //count signal edges
+        __counter->stopChannel(__channel);
+        __counter->setClockSource(Timer_TPM::external_clock, __clkin);
+    }
+
+    if (!__counter->running())
+        __counter->start(__counter->getMaxRolloverTick(), true, 0);
+}
+
+uint64_t FrequencyCounter::__ratio_q16(uint64_t num, uint64_t den) {
+    if (den == 0)
+        return 0;
+    uint64_t q = num / den;
+    uint64_t r = num - q * den;
+    return (q << 16) + (r << 16) / den;
+}
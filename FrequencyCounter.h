@@ -0,0 +1,109 @@
+/* FrequencyCounter.h
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef FREQUENCYCOUNTER_H
+#define FREQUENCYCOUNTER_H
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "Timer_TPM.h"
+
+/**
+ * Measures the frequency of an external signal without an interrupt per signal edge.
+ *
+ * High frequencies are measured by gated counting: the TPM counts signal edges on its external clock input
+ * (TPM_CLKINx) while a second timer, e.g. Timer_PIT or Timer_LPTMR, times the gate window.
+ * Low frequencies are measured reciprocally: the TPM runs from its internal clock and timestamps signal edges
+ * with input capture, and the frequency is the number of periods divided by their total duration.
+ * The counter switches between the two automatically around a crossover frequency.
+ *
+ * The signal must be routed both to a TPM_CLKINx pin and to the pin of the chosen TPM0 capture channel.
+ * The caller is responsible for the pin muxing.
+ */
+class FrequencyCounter {
+    public:
+        typedef struct {
+            uint64_t hz; //measured frequency in Hz, 48.16 fixed point
+            uint64_t resolution; //frequency corresponding to one count of measurement error, in Hz, 48.16 fixed point
+            bool reciprocal; //true if measured by input capture, false if by gated counting
+            bool valid; //false until the first measurement completes
+        } measurement_t;
+
+        /**
+         * Constructs a new FrequencyCounter.
+         * @param counter the TPM timer that counts or timestamps the signal. The counter takes it over.
+         * @param gate the timer that times the gate window. The counter takes over its callback.
+         * @param capture_channel TPM0 channel used for input capture
+         * @param clkin TPM_CLKIN pin used for gated counting, 0 or 1
+         */
+        FrequencyCounter(Timer_TPM *counter, HardwareTimer *gate, uint8_t capture_channel, uint8_t clkin);
+
+        /**
+         * Destructs the FrequencyCounter. Both timers are disabled.
+         */
+        ~FrequencyCounter();
+
+        /**
+         * Starts measuring. A new measurement completes every gate window.
+         * @param gate_period gate window length, in ticks of the gate timer
+         * @returns true if measurement started.
+         */
+        bool start(uint32_t gate_period);
+
+        /**
+         * Stops measuring and disables both timers. Does nothing if start() has not got as far as enabling them.
+         */
+        void stop();
+
+        /**
+         * Sets the frequency at which the counter switches between reciprocal and gated measurement. Below it,
+         * reciprocal measurement is used; it costs one interrupt per signal period but has far better resolution
+         * at low frequencies. The switch back to reciprocal happens at half this frequency to avoid flapping.
+         * @param hz crossover frequency in Hz. The default is DEFAULT_CROSSOVER_HZ.
+         */
+        void setCrossover(uint32_t hz);
+
+        /**
+         * Retrieves the most recent complete measurement.
+         * @param m receives a copy of the measurement
+         * @returns m->valid
+         */
+        bool getMeasurement(measurement_t *m);
+
+        const static uint32_t DEFAULT_CROSSOVER_HZ = 10000;
+
+    private:
+        void __gate_isr();
+        void __capture_isr();
+
+        /**
+         * Reconfigures the TPM for gated (reciprocal == false) or reciprocal measurement.
+         */
+        void __set_mode(bool reciprocal);
+
+        /**
+         * @returns num / den as 48.16 fixed point.
+         */
+        static uint64_t __ratio_q16(uint64_t num, uint64_t den);
+
+        Timer_TPM *__counter;
+        HardwareTimer *__gate;
+        uint8_t __channel;
+        uint8_t __clkin;
+        uint32_t __gate_period;
+        uint32_t __gate_hz; //gate timer tick rate
+        uint32_t __ref_hz; //TPM internal clock tick rate
+        uint32_t __crossover;
+        bool __reciprocal; //current mode
+        bool __primed; //a previous gate edge count is available (gated mode)
+        bool __started; //start() enabled the timers, so stop() must tear them down
+        uint64_t __last_count; //counter ticks at the previous gate edge (gated mode)
+        volatile uint32_t __edges; //captures since __first (reciprocal mode)
+        volatile uint64_t __first; //tick of the first capture in the window (reciprocal mode)
+        volatile uint64_t __last; //tick of the latest capture (reciprocal mode)
+        measurement_t __result;
+};
+
+#endif
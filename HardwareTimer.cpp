@@ -7,25 +7,42 @@
 #include "mbed.h"
 #include "HardwareTimer.h"
 
-HardwareTimer::HardwareTimer(uint32_t maxRolloverTick, float tickValue, tick_units_t tickUnits) :
+HardwareTimer::HardwareTimer(uint32_t maxRolloverTick, float tickValue, tick_units_t tickUnits, IRQn_Type irq) :
                     __valid(false),
+                    __held(0),
+                    __heldTick(0),
+                    __reloadBuffered(false),
                     __count(0),
+                    __tickBase(0),
                     __rolloverValue(0),
+                    __nextRollover(0),
+                    __period(0),
                     __periodic(false),
                     __num_callbacks(0),
-                    __user_fptr(NULL),
-                    __enabled(false),
-                    __running(false),
+                    __state(STATE_DISABLED),
+                    __current(0),
+                    __irq(irq),
                     __maxRolloverTick(maxRolloverTick),
                     __tickValue(tickValue),
-                    __tickUnits(tickUnits)
+                    __tickUnits(tickUnits),
+                    __tickHz(0),
+                    __ticksPerNsQ32(0),
+                    __epochNs(0),
+                    __epochTick(0),
+                    __delayOverhead(0),
+                    __planRemaining(0),
+                    __rolloverLast(false),
+                    __nextLast(false)
                     {
+    for (uint8_t i = 0; i < 2; i++)
+        __callbacks[i].kind = CALLBACK_NONE;
+    
+    //Nominal rate until the hardware clock configuration is read in enable()
+    __set_tick_hz((uint32_t) (1.0f / (__tickValue * HardwareTimer::tickUnits()) + 0.5f));
 }
 
 HardwareTimer::~HardwareTimer() {
     disable();
-    if (__user_fptr != NULL) //double check
-        delete __user_fptr;    
 }
 
 bool HardwareTimer::valid() {
@@ -33,11 +50,11 @@ bool HardwareTimer::valid() {
 }
 
 bool HardwareTimer::enabled() {
-    return __enabled;
+    return __state != STATE_DISABLED;
 }
 
 bool HardwareTimer::running() {
-    return __running;
+    return __state == STATE_RUNNING;
 }
 
 float HardwareTimer::tickValue() {
@@ -62,70 +79,191 @@ float HardwareTimer::tickUnits() {
     }   
 }
 
+uint32_t HardwareTimer::tickHz() {
+    return __tickHz;
+}
+
+void HardwareTimer::clockChanged() {
+    if (!__valid || __state == STATE_DISABLED)
+        return; //enable() reads the clock configuration anyway
+    
+    __lock();
+    uint64_t now = __hold(); //counter state is rebuilt from scratch
+    uint64_t elapsed = getElapsedNs();
+    uint32_t old_hz = __tickHz;
+    
+    //Ticks left until the next callback: the rest of this hardware period plus the pieces still to come
+    uint64_t left = 0;
+    if (__state == STATE_RUNNING) {
+        uint64_t end = __tickBase + __rolloverValue;
+        if (!__rolloverLast) {
+            if (__reloadBuffered) {
+                end += __nextRollover;
+                if (!__nextLast)
+                    end += __planRemaining;
+            } else
+                end += __planRemaining;
+        }
+        left = (end > now) ? end - now : 1;
+    }
+    
+    __stop_timer(); //only the counter is reprogrammed, so channel set-ups survive; __restart() resets it
+    __set_tick_hz(__clock_hz());
+    
+    //Keep the callback period, and what is left of the current one, the same length in time
+    __period = __rescale(__period, old_hz);
+    left = __rescale(left, old_hz);
+    
+    //Carry on counting from where we were at the new rate
+    __tickBase = now;
+    __epochTick = now;
+    __epochNs = elapsed;
+    
+    if (__state == STATE_RUNNING) {
+        __restart(left);
+        __finish_restart();
+    }
+    
+    __release();
+    
+    calibrateDelay();
+    __unlock();
+}
+
 void HardwareTimer::enable(void (*fptr)(void)) {
     if (!__valid)
         return;
     
-    //set user function pointer
-    if (__user_fptr != NULL)
-        delete __user_fptr;
-    if (fptr != NULL)
-        __user_fptr = new FunctionPointer(fptr);
-
-    __init_timer(); //Do hardware-specific initialization
-        
-    __enabled = true;
+    __lock();
+    uint32_t primask;
+    __callback_t *cb = __prepare(&primask);
+    if (fptr != NULL) {
+        cb->fptr.attach(fptr);
+        cb->kind = CALLBACK_FUNCTION;
+    }
+    __enable(primask);
+    __unlock();
 }
 
-
-template <typename T> void HardwareTimer::enable(T *tptr, void (T::*mptr)(void)) {
+#ifdef HARDWARETIMER_RTOS
+void HardwareTimer::enable(osThreadId thread, int32_t signals) {
     if (!__valid)
         return;
-        
-    if (__enabled)
-        disable();
-        
-    //set user function pointer
-    if (__user_fptr != NULL)
-        delete __user_fptr;
-    if (tptr != NULL && mptr != NULL)
-        __user_fptr = new FunctionPointer(tptr, mptr);
+    
+    __lock();
+    uint32_t primask;
+    __callback_t *cb = __prepare(&primask);
+    if (thread != NULL) {
+        cb->thread = thread;
+        cb->signals = signals;
+        cb->kind = CALLBACK_SIGNAL;
+    }
+    __enable(primask);
+    __unlock();
+}
 
-    __init_timer(); //Do hardware-specific initialization
+void HardwareTimer::enable(Semaphore *semaphore) {
+    if (!__valid)
+        return;
     
-    __enabled = true;
+    __lock();
+    uint32_t primask;
+    __callback_t *cb = __prepare(&primask);
+    if (semaphore != NULL) {
+        cb->semaphore = semaphore;
+        cb->kind = CALLBACK_SEMAPHORE;
+    }
+    __enable(primask);
+    __unlock();
 }
+#endif
 
 void HardwareTimer::disable() {
     if (!__valid)
         return;
-        
-    __stop_timer(); //Do hardware-specific stop
-    __running = false;
     
-    if (__user_fptr != NULL) //Detach user callback function
-        delete __user_fptr;
-    __user_fptr = NULL;
-        
-    __enabled = false;
+    __lock();
+    __disable();
+    __unlock();
 }
 
-void HardwareTimer::start(uint32_t callback_tick_count, bool periodic, uint32_t num_callbacks) {
-    if (!__valid || !__enabled || callback_tick_count > __maxRolloverTick)
+void HardwareTimer::start(uint64_t callback_tick_count, bool periodic, uint32_t num_callbacks) {
+    if (!__valid || __state == STATE_DISABLED || callback_tick_count == 0)
         return;
     
-    __rolloverValue = callback_tick_count;
+    __lock();
+    __tickBase = __hold(); //keep the tick count continuous across the restart; unchanged if the counter was stopped
+    __stop_timer();
+    
+    __period = callback_tick_count;
     __periodic = periodic;
     if (__periodic)
         __num_callbacks = 0;
     else
         __num_callbacks = num_callbacks;
     
-    __start_timer(); //Do hardware-specific start
-    __running = true;
+    __restart(0);
+    __finish_restart();
+    
+    __release();
+    
+    calibrateDelay();
+    __unlock();
+}
+
+void HardwareTimer::delay_ticks(uint32_t ticks) {
+    uint64_t start = getTick64();
+    if (!__valid || __state != STATE_RUNNING || ticks <= __delayOverhead)
+        return;
+    uint64_t deadline = start + (ticks - __delayOverhead);
+    
+    if (__get_IPSR() != 0) { //in an ISR the wake-up interrupt may not be able to preempt us, so never sleep
+        while (getTick64() < deadline)
+            ;
+        return;
+    }
+    
+    uint64_t now;
+    while ((now = getTick64()) < deadline) {
+        //Sleep only if an interrupt is sure to wake us by the deadline: a compare at the deadline if the timer can arm one,
+        //or else the next rollover. With interrupts disabled, one that is already pending still ends sleep() at once.
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq(); //CRITICAL SECTION -- the compare must not fire between arming it and sleeping
+        if (__arm_wake(deadline) || deadline - now > __rolloverValue)
+            sleep();
+        __set_PRIMASK(primask); //END CRITICAL SECTION
+    }
+}
+
+void HardwareTimer::delay_ns(uint32_t ns) {
+    delay_ticks((uint32_t) (((uint64_t) ns * __ticksPerNsQ32 + 0x80000000) >> 32));
+}
+
+void HardwareTimer::calibrateDelay() {
+    if (!__valid || __state != STATE_RUNNING)
+        return;
+    
+    __delayOverhead = 0;
+    uint32_t best = 0xFFFFFFFF;
+    for (uint8_t i = 0; i < 8; i++) { //take the minimum over a few trials to reject interrupts
+        uint32_t t0 = getTick();
+        delay_ticks(0);
+        uint32_t t1 = getTick();
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+    __delayOverhead = best;
+}
+
+bool HardwareTimer::__arm_wake(uint64_t) {
+    return false;
 }
 
-uint32_t HardwareTimer::getMaxCallbackTickCount() {
+uint64_t HardwareTimer::getMaxCallbackTickCount() {
+    return 0xFFFFFFFFFFFFFFFFULL;
+}
+
+uint32_t HardwareTimer::getMaxRolloverTick() {
     return __maxRolloverTick;
 }
 
@@ -133,22 +271,177 @@ PreciseTime HardwareTimer::getTime() {
     if (!__valid)
         return PreciseTime();
     
-    uint32_t tick = getTick();
-    uint32_t converted_ticks = tick * __tickValue;
+    return PreciseTime::from_ns64(getElapsedNs());
+}
+
+uint64_t HardwareTimer::getElapsedNs() {
+    if (!__valid || __tickHz == 0)
+        return 0;
     
-    switch (__tickUnits) {
+    //Split into whole seconds and a remainder so that the products cannot overflow
+    uint64_t ticks = getTick64() - __epochTick;
+    uint64_t sec = ticks / __tickHz;
+    uint64_t rem = ticks - sec * __tickHz;
+    return __epochNs + sec * 1000000000ULL + rem * 1000000000ULL / __tickHz;
+}
+
+void HardwareTimer::__set_tick_hz(uint32_t hz) {
+    if (hz == 0)
+        return;
+    
+    __tickHz = hz;
+    __tickValue = 1.0f / ((float) hz * tickUnits());
+    
+    uint64_t q32 = ((uint64_t) hz << 32) / 1000000000ULL;
+    __ticksPerNsQ32 = q32 > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) q32;
+}
+
+bool HardwareTimer::__rollover() {
+    __tickBase += __rolloverValue;
+    __count++;
+    bool last = __rolloverLast;
+    
+    if (__reloadBuffered) { //hardware has already switched to the period loaded last time
+        __rolloverValue = __nextRollover;
+        __rolloverLast = __nextLast;
+        __plan(&__nextRollover, &__nextLast);
+        __load_period(__nextRollover);
+    } else {
+        __plan(&__rolloverValue, &__rolloverLast);
+        __load_period(__rolloverValue);
+    }
+    
+    return last;
+}
+
+void HardwareTimer::__callback() {
+    if (__state != STATE_RUNNING || (!__periodic && __num_callbacks == 0))
+        return;
+    
+    __callback_t *cb = &__callbacks[__current]; //read the index once: enable() publishes by changing it
+    switch (cb->kind) {
+        case CALLBACK_FUNCTION:
+            cb->fptr.call();
+            break;
+#ifdef HARDWARETIMER_RTOS
+        case CALLBACK_SIGNAL:
+            osSignalSet(cb->thread, cb->signals);
+            break;
+        case CALLBACK_SEMAPHORE:
+            cb->semaphore->release();
+            break;
+#endif
         default:
-        case ns:
-            return PreciseTime::from_ns(converted_ticks);
-        case us:
-            return PreciseTime::from_us(converted_ticks);
-        case ms:
-            return PreciseTime::from_ms(converted_ticks);
-        case s:
-            return PreciseTime::from_s(converted_ticks);
-        case m:
-            return PreciseTime::from_m(converted_ticks);
-        case h:
-            return PreciseTime::from_h(converted_ticks);
+            return; //no callback, so none is counted
+    }
+    
+    if (!__periodic)
+        __num_callbacks--;
+}
+
+HardwareTimer::__callback_t *HardwareTimer::__prepare(uint32_t *primask) {
+    __disable();
+    __init_timer(); //Do hardware-specific initialization
+    __set_tick_hz(__clock_hz());
+    
+    *primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- an enable() in an ISR that preempted us must not claim the same slot
+    __callback_t *cb = &__callbacks[__current ^ 1];
+    cb->kind = CALLBACK_NONE;
+    cb->fptr.attach((void (*)(void)) NULL);
+    return cb;
+}
+
+void HardwareTimer::__enable(uint32_t primask) {
+    __DMB(); //the slot must be complete before the ISR can see it
+    __current ^= 1;
+    __state = STATE_ENABLED;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void HardwareTimer::__disable() {
+    if (__state == STATE_DISABLED)
+        return; //the hardware may not even be clocked yet, and touching it would fault
+    __state = STATE_DISABLED; //from here on, the ISR makes no callbacks
+    __stop_timer(); //Do hardware-specific stop
+}
+
+void HardwareTimer::__lock() {
+#ifdef HARDWARETIMER_RTOS
+    if (__get_IPSR() == 0) //mutexes cannot be taken in an ISR
+        __mutex.lock();
+#endif
+}
+
+void HardwareTimer::__unlock() {
+#ifdef HARDWARETIMER_RTOS
+    if (__get_IPSR() == 0)
+        __mutex.unlock();
+#endif
+}
+
+uint64_t HardwareTimer::__hold() {
+    NVIC_DisableIRQ(__irq); //only this timer's ISR uses the period state, so other interrupts stay enabled
+    
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- an ISR may start() or clockChanged() this timer while we hold it
+    if (__held == 0) //a stopped counter may read back anything (PIT CVAL), so only a running one is sampled
+        __heldTick = (__state == STATE_RUNNING) ? getTick64() : __tickBase;
+    __held++;
+    uint64_t tick = __heldTick;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return tick;
+}
+
+void HardwareTimer::__release() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    if (--__held == 0)
+        NVIC_EnableIRQ(__irq);
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void HardwareTimer::__finish_restart() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- a disable() in an ISR during the restart must not be undone
+    if (__state == STATE_DISABLED)
+        __stop_timer();
+    else
+        __state = STATE_RUNNING;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void HardwareTimer::__restart(uint64_t first) {
+    __planRemaining = first;
+    __plan(&__rolloverValue, &__rolloverLast);
+    __start_timer(); //Do hardware-specific start with __rolloverValue
+    if (__reloadBuffered) {
+        __plan(&__nextRollover, &__nextLast);
+        __load_period(__nextRollover);
     }
-}
\ No newline at end of file
+}
+
+uint64_t HardwareTimer::__rescale(uint64_t ticks, uint32_t old_hz) {
+    //Split into whole seconds and a remainder so that the products cannot overflow
+    uint64_t whole = ticks / old_hz;
+    uint64_t frac = ticks - whole * old_hz;
+    uint64_t scaled = whole * __tickHz + (frac * __tickHz + old_hz / 2) / old_hz;
+    return (scaled == 0 && ticks != 0) ? 1 : scaled;
+}
+
+void HardwareTimer::__plan(uint32_t *ticks, bool *last) {
+    if (__planRemaining == 0)
+        __planRemaining = __period;
+    
+    uint64_t chunk = __planRemaining;
+    if (chunk > __maxRolloverTick) {
+        if (chunk < 2 * (uint64_t) __maxRolloverTick)
+            chunk /= 2; //split what is left evenly rather than leave a tiny final period
+        else
+            chunk = __maxRolloverTick;
+    }
+    
+    __planRemaining -= chunk;
+    *ticks = (uint32_t) chunk;
+    *last = (__planRemaining == 0);
+}
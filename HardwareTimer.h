@@ -10,9 +10,22 @@
 #include "mbed.h"
 #include "PreciseTime.h"
 
+#ifdef HARDWARETIMER_RTOS //define when building with mbed-rtos
+#include "rtos.h"
+#endif
+
 /**
  * This provides a base class from which actual hardware timers should derive their implementations.
  * This allows for a nice software interface regardless of the particular timer used.
+ *
+ * The timer ISR reads the timer state and the callback without disabling interrupts: enable() writes the new
+ * callback into a spare slot and publishes it with a single byte store, and the enabled/running state is a single
+ * byte. start() and clockChanged() only mask the timer's own interrupt line while they rebuild the period state.
+ * Interrupts are disabled only for a few stores: while enable() claims and fills the spare slot, and while
+ * start() and clockChanged() commit the new state, so that a disable() or enable() in an ISR that preempted them
+ * is never lost. enable(), disable(), start() and clockChanged() may therefore be called from ISRs.
+ * With HARDWARETIMER_RTOS defined, they are also serialized by a mutex between threads, so different threads may
+ * control the same timer, and expiry can signal a thread or release a semaphore instead of calling a function.
  */
 class HardwareTimer {
     public:
@@ -32,8 +45,9 @@ class HardwareTimer {
          * @param maxRolloverTick maximum number of ticks in the hardware unit before it rolls over.
          * @param tickValue the amount of time corresponding to each timer tick, in units given by tickUnits.
          * @param tickUnits units for tickValue
+         * @param irq interrupt line of the hardware unit
          */
-        HardwareTimer(uint32_t maxRolloverTick, float tickValue, tick_units_t tickUnits);
+        HardwareTimer(uint32_t maxRolloverTick, float tickValue, tick_units_t tickUnits, IRQn_Type irq);
         
         /**
          * Destructs the HardwareTimer.
@@ -65,6 +79,24 @@ class HardwareTimer {
          */
         float tickUnits();
         
+        /**
+         * @returns the number of ticks per second. This is derived from the live clock configuration when the timer
+         * is enabled and whenever clockChanged() is called.
+         */
+        uint32_t tickHz();
+        
+        /**
+         * Must be called after the MCG or SIM clock dividers are reconfigured, e.g. to run slower while idle.
+         * The time elapsed so far is saved, the tick rate is re-derived from the new clock configuration, and the
+         * hardware counter is restarted with the callback period rescaled to the same duration. getTick64() carries on
+         * from its current value at the new tick rate, so absolute tick deadlines held elsewhere stay in the future, and
+         * getTime() and getElapsedNs() continue without a jump. The callback period in progress is finished, with its
+         * remaining ticks rescaled, rather than started over.
+         * Only the counter is reprogrammed. On Timer_TPM, pulse trains, input captures and scheduled edges keep running;
+         * edges still fire at their absolute tick, and pulse widths stay the same number of ticks.
+         */
+        void clockChanged();
+        
         /**
          * Enables the timer with a user-specified callback function that is called each time the timer expires.
          * @param fptr the user callback function
@@ -78,6 +110,23 @@ class HardwareTimer {
          */
         template<typename T> void enable(T *tptr, void (T::*mptr)(void));
         
+#ifdef HARDWARETIMER_RTOS
+        /**
+         * Enables the timer so that each expiry sets signal flags on a thread, waking it from Thread::signal_wait().
+         * No function is called from the ISR.
+         * @param thread the thread to signal
+         * @param signals the signal flags to set
+         */
+        void enable(osThreadId thread, int32_t signals);
+        
+        /**
+         * Enables the timer so that each expiry releases a semaphore, waking one thread waiting on it.
+         * No function is called from the ISR.
+         * @param semaphore the semaphore to release
+         */
+        void enable(Semaphore *semaphore);
+#endif
+        
         /**
          * Stops and disables the timer. No user function callbacks will be made, and the tick value stops increasing.
          */
@@ -85,21 +134,56 @@ class HardwareTimer {
         
         /**
          * Starts the timer. If valid() or enabled() are false, then this method does nothing. Otherwise, the timer
-         * begins ticking. The user callback function specified in enableTimer() is called each time the timer rolls over.
+         * begins ticking. The user callback function specified in enableTimer() is called each time callback_tick_count
+         * ticks have elapsed.
          * @param callback_tick_count the modulo tick value for when the timer calls the user callback function.
-         * Note that the timer counts up. Note that some timers may not support the full 32-bit range. Use getMaxCallbackTickCount()
-         * To check the maximum allowed value. If callback_tick_count is greater than that value, this method will have no effect.
+         * Note that the timer counts up. Periods longer than getMaxRolloverTick() are split internally into several
+         * hardware rollovers, with no callbacks in between, so any 64-bit period can be used on any timer.
+         * If callback_tick_count is 0, this method will have no effect.
          * @param periodic if true, the timer will call the user function every time the internal tick modulo callback_tick_count is reached.
          * If false, the user callback function is only called the first num_callbacks times.
          * @param num_callbacks if periodic is set to false, this many callbacks will be made. Before the timer stops.
          */
-        void start(uint32_t callback_tick_count, bool periodic, uint32_t num_callbacks);
+        void start(uint64_t callback_tick_count, bool periodic, uint32_t num_callbacks);
+        
+        /**
+         * Waits for the given number of timer ticks. The timer must be running (see start()).
+         * Where the timer has a spare compare unit (a free TPM0 channel on Timer_TPM), the CPU sleeps until a compare
+         * interrupt at the deadline. Otherwise it sleeps until the final rollover period before the deadline, letting
+         * the timer's own rollover interrupt wake it, and then spins on getTick64() for the remainder.
+         * Called from an ISR, it always spins, since the wake-up interrupt may not be able to preempt the caller.
+         * The spin then relies on getTick64() seeing rollovers the ISR cannot service, which holds for one rollover
+         * period, so keep such delays shorter than that.
+         * The calibrated entry overhead (see calibrateDelay()) is subtracted from the request.
+         * Note that interrupts, including the user callback, can lengthen the delay.
+         * @param ticks number of ticks to wait
+         */
+        void delay_ticks(uint32_t ticks);
+        
+        /**
+         * Busy-waits for the given number of nanoseconds, rounded to the nearest timer tick.
+         * See delay_ticks() for details.
+         * @param ns number of nanoseconds to wait
+         */
+        void delay_ns(uint32_t ns);
+        
+        /**
+         * Measures the fixed cost of entering and leaving delay_ticks() so it can be subtracted from later delays.
+         * This is done automatically by start(), but may be repeated if e.g. the core clock changes.
+         */
+        void calibrateDelay();
         
         /**
-         * @returns the maximum value of the user-settable callback tick count (via startTimer()).
-         * Some timers may support full 32-bit tick counts, while others may be less.
+         * @returns the maximum value of the user-settable callback tick count (via start()). Since long periods are
+         * split in software, this is the full 64-bit range on every timer.
          */
-        uint32_t getMaxCallbackTickCount();
+        uint64_t getMaxCallbackTickCount();
+        
+        /**
+         * @returns the maximum number of ticks in a single hardware rollover. Callback periods up to this value
+         * cause exactly one interrupt per callback. Some timers support full 32-bit tick counts, while others may be less.
+         */
+        uint32_t getMaxRolloverTick();
         
         /**
          * Gets the timer value in a nice form.
@@ -110,6 +194,11 @@ class HardwareTimer {
          */
         PreciseTime getTime();
         
+        /**
+         * @returns the time elapsed on this timer in nanoseconds, continuous across clockChanged().
+         */
+        uint64_t getElapsedNs();
+        
         /**
          * @returns the current tick number. Convert to seconds by multiplying the return value with tickValue().
          * Note that getTick() * tickValue() can easily overflow on faster timers due to the 32-bit upper bound
@@ -117,6 +206,11 @@ class HardwareTimer {
          */
         virtual uint32_t getTick() = 0;
         
+        /**
+         * @returns the current tick number as a 64-bit value. Unlike getTick(), this does not wrap around in practice.
+         */
+        virtual uint64_t getTick64() = 0;
+        
         /**
          * Interrupt service routine for the timer. This should do timer hardware-specific chores before calling the user
          * callback function.
@@ -139,20 +233,173 @@ class HardwareTimer {
          */
         virtual void __stop_timer() = 0;
         
+        /**
+         * @returns the frequency in Hz at which the particular hardware timer ticks, read from the live clock configuration.
+         */
+        virtual uint32_t __clock_hz() = 0;
+        
+        /**
+         * Loads the length of a hardware rollover period into the particular hardware timer.
+         * @param ticks period length, 1 to getMaxRolloverTick()
+         */
+        virtual void __load_period(uint32_t ticks) = 0;
+        
+        /**
+         * Arms a one-shot interrupt at the given tick so that sleep() in delay_ticks() returns on time. The particular
+         * hardware timer disarms it again from its ISR. The default does nothing, for timers without a spare compare unit.
+         * Called with interrupts disabled.
+         * @param tick absolute tick, on the getTick64() scale
+         * @returns true if the interrupt was armed.
+         */
+        virtual bool __arm_wake(uint64_t tick);
+        
+        /**
+         * Sets the tick rate, updating tickValue() and the delay conversion.
+         */
+        void __set_tick_hz(uint32_t hz);
+        
+        /**
+         * Must be called by the ISR on each hardware rollover. Advances the tick base, moves on to the next
+         * hardware period, and loads the one after it. The ISR should clear the rollover flag and call this with
+         * interrupts disabled, so that getTick64() in a higher-priority ISR never sees one without the other.
+         * @returns true if a callback period ended, in which case the ISR should call __callback().
+         */
+        bool __rollover();
+        
+        /**
+         * Calls the user callback function, honouring periodic and num_callbacks.
+         */
+        void __callback();
+        
         bool __valid; //timer can be used
-        volatile uint32_t __count; //number of rollovers
-        uint32_t __rolloverValue; //ticks per rollover
+        volatile uint8_t __held; //start() or clockChanged() is rebuilding the counter state: getTick64() returns __heldTick
+        volatile uint64_t __heldTick; //tick count at which the counter was stopped for the rebuild
+        bool __reloadBuffered; //set by the derived class if a newly loaded period only takes effect after the next rollover
+        volatile uint32_t __count; //number of hardware rollovers
+        volatile uint64_t __tickBase; //ticks elapsed before the current hardware period
+        uint32_t __rolloverValue; //ticks in the current hardware period
+        uint32_t __nextRollover; //hardware period already loaded to follow the current one, if __reloadBuffered
+        uint64_t __period; //ticks per callback
         bool __periodic; //periodic callbacks
         volatile uint32_t __num_callbacks;
-        
-        FunctionPointer *__user_fptr; //User callback function
 
     private:   
-        bool __enabled; //timer is configured
-        bool __running; //timer is running     
+        typedef struct {
+            uint8_t kind; //what to do on expiry, one of the CALLBACK_ constants
+            FunctionPointer fptr; //User callback function
+#ifdef HARDWARETIMER_RTOS
+            osThreadId thread;
+            int32_t signals;
+            Semaphore *semaphore;
+#endif
+        } __callback_t;
+        
+        /**
+         * Disables the timer if it is enabled and initializes the hardware, then disables interrupts so that the
+         * caller can fill in the spare slot without an enable() in an ISR claiming it too.
+         * @param primask receives the interrupt mask for __enable() to restore
+         * @returns the spare callback slot, cleared, for the caller to fill in before __enable().
+         */
+        __callback_t *__prepare(uint32_t *primask);
+        
+        /**
+         * Publishes the spare callback slot, marks the timer enabled, and restores the interrupt mask.
+         * @param primask the interrupt mask returned by __prepare()
+         */
+        void __enable(uint32_t primask);
+        
+        /**
+         * Stops the timer if it is enabled. Does nothing otherwise, so it is safe on hardware that was never clocked.
+         */
+        void __disable();
+        
+        /**
+         * Serializes enable(), disable(), start() and clockChanged() between threads. Does nothing in an ISR,
+         * or without HARDWARETIMER_RTOS.
+         */
+        void __lock();
+        void __unlock();
+        
+
+        /**
+         * Stops this timer's ISR and freezes getTick64() for other interrupts, before the counter state is rebuilt.
+         * Calls may nest, e.g. when an ISR restarts a timer that a thread is restarting.
+         * @returns the tick count at which the counter stopped, or __tickBase if it was not running
+         */
+        uint64_t __hold();
+        
+        /**
+         * Lets the ISR and getTick64() see the rebuilt counter state once the outermost __hold() is released.
+         */
+        void __release();
+        
+        /**
+         * Marks the timer running after __restart(), unless disable() ran in an ISR meanwhile, in which case the
+         * restarted hardware is stopped again.
+         */
+        void __finish_restart();
+        
+        /**
+         * Starts the hardware counter from zero. __tickBase must already hold the tick count to continue from.
+         * @param first ticks until the first callback, or 0 for a full callback period
+         */
+        void __restart(uint64_t first);
+        
+        /**
+         * @returns ticks at old_hz converted to the same duration at the current tick rate, rounded, and at least 1
+         * unless ticks is 0.
+         */
+        uint64_t __rescale(uint64_t ticks, uint32_t old_hz);
+        
+        /**
+         * Splits the next hardware period off the callback period. The last two pieces of a long period are
+         * balanced so that neither is too short to service.
+         */
+        void __plan(uint32_t *ticks, bool *last);
+        
+        volatile uint8_t __state; //one of the STATE_ constants, so that it changes in a single store
+        __callback_t __callbacks[2]; //the ISR uses __callbacks[__current]; the other is filled in by enable()
+        volatile uint8_t __current;
+#ifdef HARDWARETIMER_RTOS
+        Mutex __mutex;
+#endif
+        IRQn_Type __irq; //interrupt line of the hardware unit
         uint32_t __maxRolloverTick; //maximum number of ticks before timer hardware rolls over
         float __tickValue; //how many units per tick
         tick_units_t __tickUnits; //tick units
+        uint32_t __tickHz; //ticks per second
+        uint32_t __ticksPerNsQ32; //ticks per nanosecond, as a 0.32 fixed-point fraction
+        uint64_t __epochNs; //time elapsed before the last clock change
+        uint64_t __epochTick; //getTick64() at the last clock change
+        uint32_t __delayOverhead; //ticks spent entering and leaving delay_ticks()
+        uint64_t __planRemaining; //ticks of the current callback period not yet given to the hardware
+        bool __rolloverLast; //current hardware period ends a callback period
+        bool __nextLast; //next hardware period ends a callback period
+        
+        const static uint8_t STATE_DISABLED = 0;
+        const static uint8_t STATE_ENABLED = 1; //configured but not running
+        const static uint8_t STATE_RUNNING = 2;
+        
+        const static uint8_t CALLBACK_NONE = 0;
+        const static uint8_t CALLBACK_FUNCTION = 1;
+        const static uint8_t CALLBACK_SIGNAL = 2;
+        const static uint8_t CALLBACK_SEMAPHORE = 3;
 };
 
+//Template definitions must be visible to every translation unit that instantiates them
+template <typename T> void HardwareTimer::enable(T *tptr, void (T::*mptr)(void)) {
+    if (!__valid)
+        return;
+    
+    __lock();
+    uint32_t primask;
+    __callback_t *cb = __prepare(&primask);
+    if (tptr != NULL && mptr != NULL) {
+        cb->fptr.attach(tptr, mptr);
+        cb->kind = CALLBACK_FUNCTION;
+    }
+    __enable(primask);
+    __unlock();
+}
+
 #endif
\ No newline at end of file
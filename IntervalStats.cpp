@@ -0,0 +1,228 @@
+/* IntervalStats.cpp
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "IntervalStats.h"
+
+const uint16_t IntervalStats::QUANTILE_PERMILLE[NUM_QUANTILES] = { 500, 900, 990, 999 };
+
+IntervalStats::IntervalStats(HardwareTimer *timer) :
+                    __timer(timer)
+                    {
+    reset();
+}
+
+uint32_t IntervalStats::mark() {
+    return __timer->getTick();
+}
+
+void IntervalStats::sample(uint32_t start_tick) {
+    add(__timer->getTick() - start_tick);
+}
+
+void IntervalStats::add(uint32_t ticks) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- samples may come from several ISRs
+
+    __count++;
+    if (ticks < __min)
+        __min = ticks;
+    if (ticks > __max)
+        __max = ticks;
+
+    //Welford: mean += delta / n, M2 += delta * (x - new mean). Both deltas have the same sign.
+    int64_t x = (int64_t) ticks << 24;
+    int64_t delta = x - __mean;
+    uint64_t step = __udiv((uint64_t) (delta < 0 ? -delta : delta) + __count / 2, __count); //rounded |delta| / n
+    __mean += (delta < 0) ? -(int64_t) step : (int64_t) step;
+    int64_t delta2 = x - __mean;
+    uint64_t sq = __mul_q48((uint64_t) (delta < 0 ? -delta : delta), (uint64_t) (delta2 < 0 ? -delta2 : delta2));
+    __m2 = (__m2 + sq < __m2) ? 0xFFFFFFFFFFFFFFFFULL : __m2 + sq;
+
+    //P-square percentile estimators. The first five samples initialize the markers of every estimator.
+    if (__count <= 5) {
+        for (uint8_t q = 0; q < NUM_QUANTILES; q++) {
+            uint32_t *h = __p2[q].height;
+            uint8_t i = __count - 1;
+            while (i > 0 && h[i-1] > ticks) { //insertion sort
+                h[i] = h[i-1];
+                i--;
+            }
+            h[i] = ticks;
+            __p2[q].pos[__count - 1] = __count;
+        }
+    } else {
+        for (uint8_t q = 0; q < NUM_QUANTILES; q++)
+            __p2_add(q, ticks);
+    }
+
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void IntervalStats::reset() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    __count = 0;
+    __min = 0xFFFFFFFF;
+    __max = 0;
+    __mean = 0;
+    __m2 = 0;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+uint32_t IntervalStats::getCount() {
+    return __count;
+}
+
+uint32_t IntervalStats::getMin() {
+    return __count > 0 ? __min : 0;
+}
+
+uint32_t IntervalStats::getMax() {
+    return __max;
+}
+
+uint64_t IntervalStats::getMean() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- 64-bit value updated by add()
+    int64_t mean = __mean;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return mean < 0 ? 0 : (uint64_t) mean >> 16;
+}
+
+uint64_t IntervalStats::getVariance() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    uint64_t m2 = __m2;
+    uint32_t count = __count;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+
+    if (count < 2)
+        return 0;
+    return m2 / (count - 1);
+}
+
+uint32_t IntervalStats::getStdDev() {
+    return __isqrt(getVariance());
+}
+
+uint32_t IntervalStats::getQuantile(quantile_t q) {
+    if (q >= NUM_QUANTILES)
+        return 0;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    uint32_t count = __count;
+    uint32_t result = 0;
+    if (count > 5)
+        result = __p2[q].height[2];
+    else if (count > 0) //markers hold the sorted samples: pick the nearest rank
+        result = __p2[q].height[((count - 1) * QUANTILE_PERMILLE[q] + 500) / 1000];
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return result;
+}
+
+void IntervalStats::__p2_add(uint8_t q, uint32_t x) {
+    uint32_t *h = __p2[q].height;
+    uint32_t *n = __p2[q].pos;
+
+    //Find the cell containing x, extending the extreme markers if needed
+    uint8_t k;
+    if (x < h[0]) {
+        h[0] = x;
+        k = 0;
+    } else if (x >= h[4]) {
+        h[4] = x;
+        k = 3;
+    } else {
+        k = 0;
+        while (x >= h[k+1])
+            k++;
+    }
+
+    for (uint8_t i = k + 1; i < 5; i++)
+        n[i]++;
+
+    //Move the middle markers towards their desired positions
+    for (uint8_t i = 1; i < 4; i++) {
+        int64_t d = __p2_desired(q, i) - ((int64_t) n[i] << 16);
+        int32_t s;
+        if (d >= 0x10000 && n[i+1] - n[i] > 1)
+            s = 1;
+        else if (d <= -0x10000 && n[i] - n[i-1] > 1)
+            s = -1;
+        else
+            continue;
+
+        //Marker gaps and height differences are never negative, so all of this is unsigned 32-bit values.
+        //Only the two products need 64 bits, and __udiv() divides them in 32 bits whenever they fit.
+        uint32_t a = n[i] - n[i-1];
+        uint32_t b = n[i+1] - n[i];
+        uint32_t up = h[i+1] - h[i];
+        uint32_t down = h[i] - h[i-1];
+
+        //Piecewise-parabolic prediction, falling back to linear if it would leave the neighbouring markers
+        uint64_t t = __udiv((uint64_t) (a + s) * up, b) + __udiv((uint64_t) (b - s) * down, a);
+        uint64_t move = __udiv(t, a + b);
+        bool inside = (s > 0) ? (move < up && (move > 0 || down > 0)) : (move < down && (move > 0 || up > 0));
+        if (inside) {
+            if (s > 0)
+                h[i] += (uint32_t) move;
+            else
+                h[i] -= (uint32_t) move;
+        } else if (s > 0)
+            h[i] += up / b;
+        else
+            h[i] -= down / a;
+        n[i] += s;
+    }
+}
+
+int64_t IntervalStats::__p2_desired(uint8_t q, uint8_t i) {
+    //Desired position is 1 + (count - 1) * f, with f = 0, p/2, p, (1+p)/2, 1 for the five markers
+    uint32_t p = ((uint32_t) QUANTILE_PERMILLE[q] << 16) / 1000;
+    uint32_t f;
+    switch (i) {
+        default:
+        case 0: f = 0; break;
+        case 1: f = p / 2; break;
+        case 2: f = p; break;
+        case 3: f = (0x10000 + p) / 2; break;
+        case 4: f = 0x10000; break;
+    }
+    return 0x10000 + (int64_t) (__count - 1) * f;
+}
+
+uint64_t IntervalStats::__udiv(uint64_t num, uint32_t den) {
+    //The Cortex-M0+ has no divide instruction, and the 64-bit library division is several times slower than the 32-bit one
+    if ((num >> 32) == 0)
+        return (uint32_t) num / den;
+    return num / den;
+}
+
+uint64_t IntervalStats::__mul_q48(uint64_t a, uint64_t b) {
+    //(a * b) >> 48 from 32-bit partial products. Operands are below 2^56, so the result fits.
+    uint64_t ah = a >> 32, al = a & 0xFFFFFFFF;
+    uint64_t bh = b >> 32, bl = b & 0xFFFFFFFF;
+    return ((ah * bh) << 16) + ((ah * bl + al * bh) >> 16) + ((al * bl) >> 48);
+}
+
+uint32_t IntervalStats::__isqrt(uint64_t v) {
+    //Bitwise integer square root
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > v)
+        bit >>= 2;
+    while (bit != 0) {
+        if (v >= root + bit) {
+            v -= root + bit;
+            root = (root >> 1) + bit;
+        } else
+            root >>= 1;
+        bit >>= 2;
+    }
+    return (uint32_t) root;
+}
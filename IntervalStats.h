@@ -0,0 +1,134 @@
+/* IntervalStats.h
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef INTERVALSTATS_H
+#define INTERVALSTATS_H
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+
+/**
+ * Fixed-memory streaming statistics over intervals measured in HardwareTimer ticks.
+ * Keeps count, min, max, mean and variance (Welford's method in fixed point), and estimates of the 50th, 90th,
+ * 99th and 99.9th percentiles (P-square algorithm, one estimator per percentile). No samples are stored, every
+ * update is O(1), and no floating point is used, so samples may be added from interrupt service routines.
+ * The whole object takes about 200 bytes.
+ */
+class IntervalStats {
+    public:
+        typedef enum {
+            p50,
+            p90,
+            p99,
+            p999
+        } quantile_t;
+
+        /**
+         * Constructs a new IntervalStats.
+         * @param timer time base for mark() and sample(). May be NULL if only add() is used.
+         */
+        IntervalStats(HardwareTimer *timer);
+
+        /**
+         * @returns the current tick of the timer, to be passed to sample() when the interval ends.
+         */
+        uint32_t mark();
+
+        /**
+         * Adds the interval from start_tick until now.
+         * @param start_tick value returned by mark() when the interval began
+         */
+        void sample(uint32_t start_tick);
+
+        /**
+         * Adds an interval.
+         * @param ticks interval length in ticks
+         */
+        void add(uint32_t ticks);
+
+        /**
+         * Discards all samples.
+         */
+        void reset();
+
+        /**
+         * @returns the number of samples added.
+         */
+        uint32_t getCount();
+
+        /**
+         * @returns the smallest sample, or 0 if there are none.
+         */
+        uint32_t getMin();
+
+        /**
+         * @returns the largest sample, or 0 if there are none.
+         */
+        uint32_t getMax();
+
+        /**
+         * @returns the mean of the samples in ticks, with 8 fractional bits.
+         */
+        uint64_t getMean();
+
+        /**
+         * @returns the sample variance in ticks squared, or 0 with fewer than two samples.
+         * Saturates instead of overflowing for extremely spread-out data.
+         */
+        uint64_t getVariance();
+
+        /**
+         * @returns the sample standard deviation in ticks, rounded down.
+         */
+        uint32_t getStdDev();
+
+        /**
+         * @param q which percentile
+         * @returns the estimated percentile in ticks, or 0 if there are no samples.
+         */
+        uint32_t getQuantile(quantile_t q);
+
+        const static uint8_t NUM_QUANTILES = 4;
+
+    private:
+        typedef struct {
+            uint32_t height[5]; //marker heights, in ticks
+            uint32_t pos[5]; //marker positions, 1-based
+        } __p2_t;
+
+        /**
+         * Adds a sample to one P-square estimator once the first five samples have been seen.
+         */
+        void __p2_add(uint8_t q, uint32_t x);
+
+        /**
+         * @returns the desired position of marker i of estimator q, 16.16 fixed point.
+         */
+        int64_t __p2_desired(uint8_t q, uint8_t i);
+
+        /**
+         * @returns num / den, using 32-bit division when num fits in 32 bits.
+         */
+        static uint64_t __udiv(uint64_t num, uint32_t den);
+
+        /**
+         * @returns (a * b) >> 48 without intermediate overflow.
+         */
+        static uint64_t __mul_q48(uint64_t a, uint64_t b);
+
+        static uint32_t __isqrt(uint64_t v);
+
+        HardwareTimer *__timer;
+        uint32_t __count;
+        uint32_t __min;
+        uint32_t __max;
+        int64_t __mean; //ticks, with 24 fractional bits
+        uint64_t __m2; //sum of squared deviations, ticks squared
+        __p2_t __p2[NUM_QUANTILES];
+
+        const static uint16_t QUANTILE_PERMILLE[NUM_QUANTILES];
+};
+
+#endif
@@ -18,8 +18,151 @@ PreciseTime::PreciseTime() :
                 
                 
 void PreciseTime::print() {
-   // printf("HH:MM:SS:ms:us:ns\r\n");
-   printf("%02u:%02u:%02u:%03u:%03u:%03u", h, m, s, ms, us, ns); 
+    //Keeps the HH:MM:SS:mmm:uuu:nnn layout print() has always had, so existing log parsers still work
+    char buf[FORMAT_MAX_LEN];
+    char *p = buf;
+    p = __write_uint(p, h, 2);
+    *p++ = ':';
+    p = __write_uint(p, m, 2);
+    *p++ = ':';
+    p = __write_uint(p, s, 2);
+    *p++ = ':';
+    p = __write_uint(p, ms, 3);
+    *p++ = ':';
+    p = __write_uint(p, us, 3);
+    *p++ = ':';
+    p = __write_uint(p, ns, 3);
+    *p = '\0';
+    fputs(buf, stdout);
+}
+
+size_t PreciseTime::format(char *buf, size_t len, format_t fmt) const {
+    char scratch[FORMAT_MAX_LEN];
+    char *p = scratch;
+    
+    switch (fmt) {
+        default:
+        case hms: //HH:MM:SS.mmmuuunnn
+            p = __write_uint(p, h, 2);
+            *p++ = ':';
+            p = __write_uint(p, m, 2);
+            *p++ = ':';
+            p = __write_uint(p, s, 2);
+            *p++ = '.';
+            p = __write_fraction(p);
+            break;
+        case iso8601: { //PT#H#M#.#########S, omitting zero components and trailing fractional zeros
+            bool has_frac = (ms | us | ns) != 0;
+            *p++ = 'P';
+            *p++ = 'T';
+            if (h != 0) {
+                p = __write_uint(p, h, 1);
+                *p++ = 'H';
+            }
+            if (m != 0) {
+                p = __write_uint(p, m, 1);
+                *p++ = 'M';
+            }
+            if (s != 0 || has_frac || (h == 0 && m == 0)) {
+                p = __write_uint(p, s, 1);
+                if (has_frac) {
+                    *p++ = '.';
+                    p = __write_fraction(p);
+                    while (*(p-1) == '0')
+                        p--;
+                }
+                *p++ = 'S';
+            }
+            break;
+        }
+        case decimal: //seconds.#########
+            p = __write_uint64(p, ((uint64_t) h * MIN_PER_HOUR + m) * SEC_PER_MIN + s, 1);
+            *p++ = '.';
+            p = __write_fraction(p);
+            break;
+    }
+    
+    size_t n = p - scratch;
+    if (buf == NULL || n >= len)
+        return 0;
+    memcpy(buf, scratch, n);
+    buf[n] = '\0';
+    return n;
+}
+
+char *PreciseTime::__write_uint(char *dst, uint32_t v, uint8_t min_digits) {
+    //Two ASCII digits for each value 0..99
+    static const char pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    static const uint32_t pow10[10] = {
+        1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL,
+        10000UL, 1000UL, 100UL, 10UL, 1UL
+    };
+    
+    bool leading = true;
+    if (v >= 1000) { //only fields that were not normalized get here
+        for (uint8_t i = 0; i < 7; i++) {
+            char digit = '0';
+            while (v >= pow10[i]) {
+                v -= pow10[i];
+                digit++;
+            }
+            if (digit != '0' || 10 - i <= min_digits)
+                leading = false;
+            if (!leading)
+                *dst++ = digit;
+        }
+    }
+    
+    char hundreds = '0';
+    while (v >= 100) {
+        v -= 100;
+        hundreds++;
+    }
+    if (hundreds != '0' || min_digits >= 3)
+        leading = false;
+    if (!leading)
+        *dst++ = hundreds;
+    if (v >= 10 || min_digits >= 2)
+        leading = false;
+    if (!leading)
+        *dst++ = pairs[2 * v];
+    *dst++ = pairs[2 * v + 1];
+    return dst;
+}
+
+char *PreciseTime::__write_uint64(char *dst, uint64_t v, uint8_t min_digits) {
+    //Powers of ten for digit extraction by repeated subtraction. The target has no hardware divider,
+    //so this is much cheaper than / and % on 64-bit values.
+    static const uint64_t pow10[20] = {
+        10000000000000000000ULL, 1000000000000000000ULL, 100000000000000000ULL, 10000000000000000ULL,
+        1000000000000000ULL, 100000000000000ULL, 10000000000000ULL, 1000000000000ULL,
+        100000000000ULL, 10000000000ULL, 1000000000ULL, 100000000ULL,
+        10000000ULL, 1000000ULL, 100000ULL, 10000ULL,
+        1000ULL, 100ULL, 10ULL, 1ULL
+    };
+    
+    bool leading = true;
+    for (uint8_t i = 0; i < 20; i++) {
+        char digit = '0';
+        while (v >= pow10[i]) {
+            v -= pow10[i];
+            digit++;
+        }
+        if (digit != '0' || 20 - i <= min_digits || i == 19)
+            leading = false;
+        if (!leading)
+            *dst++ = digit;
+    }
+    return dst;
+}
+
+char *PreciseTime::__write_fraction(char *dst) const {
+    dst = __write_uint(dst, ms, 3);
+    dst = __write_uint(dst, us, 3);
+    return __write_uint(dst, ns, 3);
 }
 
 uint32_t PreciseTime::to_h(PreciseTime obj) {
@@ -27,25 +170,28 @@ uint32_t PreciseTime::to_h(PreciseTime obj) {
 }
 
 uint32_t PreciseTime::to_m(PreciseTime obj) {
-    return to_h(obj)*MIN_PER_HOUR + obj.m;
+    return __accumulate(to_h(obj), MIN_PER_HOUR, obj.m);
 }
 
 uint32_t PreciseTime::to_s(PreciseTime obj) {
-    return to_m(obj)*SEC_PER_MIN + obj.s;
+    return __accumulate(to_m(obj), SEC_PER_MIN, obj.s);
 }
 
 uint32_t PreciseTime::to_ms(PreciseTime obj) {
-    return to_s(obj)*MS_PER_SEC + obj.ms;
+    return __accumulate(to_s(obj), MS_PER_SEC, obj.ms);
 }
 
 uint32_t PreciseTime::to_us(PreciseTime obj) {
-    return to_ms(obj)*US_PER_MS + obj.us;
+    return __accumulate(to_ms(obj), US_PER_MS, obj.us);
 }
 
 uint32_t PreciseTime::to_ns(PreciseTime obj) {
-    return to_us(obj)*NS_PER_US + obj.ns;
+    return __accumulate(to_us(obj), NS_PER_US, obj.ns);
 }
 
+//Each from_ function splits off its own unit exactly and hands the quotient to the next larger unit.
+//This is pure integer division: the float reciprocals used before rounded wrongly near unit boundaries.
+
 PreciseTime PreciseTime::from_h(uint32_t h) {
     PreciseTime obj;
     obj.h = h;
@@ -53,66 +199,50 @@ PreciseTime PreciseTime::from_h(uint32_t h) {
 }
 
 PreciseTime PreciseTime::from_m(uint32_t m) {
-    PreciseTime obj;
-    obj.h = m * HOUR_PER_MIN;
+    PreciseTime obj = from_h(m / MIN_PER_HOUR);
     obj.m = m % MIN_PER_HOUR;
     return obj;    
 }
 
 PreciseTime PreciseTime::from_s(uint32_t s) {
-    PreciseTime obj;
-    obj.m = s * MIN_PER_SEC;
+    PreciseTime obj = from_m(s / SEC_PER_MIN);
     obj.s = s % SEC_PER_MIN;
-    
-    obj.h = obj.m * HOUR_PER_MIN;
-    obj.m = obj.m % MIN_PER_HOUR;
     return obj;     
 }
 
 PreciseTime PreciseTime::from_ms(uint32_t ms) {
-    PreciseTime obj;
-    obj.s = ms * SEC_PER_MS;
+    PreciseTime obj = from_s(ms / MS_PER_SEC);
     obj.ms = ms % MS_PER_SEC;
-    
-    obj.m = obj.s * MIN_PER_SEC;
-    obj.s = obj.s % SEC_PER_MIN;
-    
-    obj.h = obj.m * HOUR_PER_MIN;
-    obj.m = obj.m % MIN_PER_HOUR;
     return obj; 
 }
 
 PreciseTime PreciseTime::from_us(uint32_t us) {
-    PreciseTime obj;
-    obj.ms = us * MS_PER_US;
+    PreciseTime obj = from_ms(us / US_PER_MS);
     obj.us = us % US_PER_MS;
-    
-    obj.s = obj.ms * SEC_PER_MS;
-    obj.ms = obj.ms % MS_PER_SEC;
-    
-    obj.m = obj.s * MIN_PER_SEC;
-    obj.s = obj.s % SEC_PER_MIN;
-    
-    obj.h = obj.m * HOUR_PER_MIN;
-    obj.m = obj.m % MIN_PER_HOUR;
     return obj;    
 }
 
 PreciseTime PreciseTime::from_ns(uint32_t ns) {
-    PreciseTime obj;
-    obj.us = ns * US_PER_NS;
+    PreciseTime obj = from_us(ns / NS_PER_US);
     obj.ns = ns % NS_PER_US;
+    return obj;
+}
+
+PreciseTime PreciseTime::from_ns64(uint64_t ns) {
+    //One 64-bit division splits off the seconds; everything below a second fits in 32 bits
+    const uint64_t NS_PER_SEC = (uint64_t) NS_PER_US * US_PER_MS * MS_PER_SEC;
+    uint64_t sec = ns / NS_PER_SEC;
+    uint32_t rem = (uint32_t) (ns - sec * NS_PER_SEC);
     
-    obj.ms = obj.us * MS_PER_US;
-    obj.us = obj.us % US_PER_MS;
-    
-    obj.s = obj.ms * SEC_PER_MS;
-    obj.ms = obj.ms % MS_PER_SEC;
-    
-    obj.m = obj.s * MIN_PER_SEC;
-    obj.s = obj.s % SEC_PER_MIN;
-    
-    obj.h = obj.m * HOUR_PER_MIN;
-    obj.m = obj.m % MIN_PER_HOUR;
-    return obj;     
-}
\ No newline at end of file
+    PreciseTime obj = from_m((uint32_t) (sec / SEC_PER_MIN)); //below 2^32 minutes for any 64-bit ns count
+    obj.s = (uint32_t) (sec % SEC_PER_MIN);
+    obj.ms = rem / (NS_PER_US * US_PER_MS);
+    obj.us = (rem / NS_PER_US) % US_PER_MS;
+    obj.ns = rem % NS_PER_US;
+    return obj;
+}
+
+uint32_t PreciseTime::__accumulate(uint32_t coarse, uint32_t factor, uint32_t fine) {
+    uint64_t v = (uint64_t) coarse * factor + fine; //cannot overflow 64 bits
+    return v > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) v;
+}
@@ -16,13 +16,33 @@
  */
 class PreciseTime {
     public:
+        typedef enum {
+            hms,
+            iso8601,
+            decimal
+        } format_t;
+        
         PreciseTime();
         
         /**
-         * Prints an ASCII representation of this object.
+         * Prints an ASCII representation of this object as HH:MM:SS:mmm:uuu:nnn. Use format() for the other layouts.
          */
         void print();
         
+        /**
+         * Writes an ASCII representation of this object into a caller-supplied buffer. This does not use printf,
+         * does not allocate memory, and does not block, so it is safe to call from an interrupt service routine.
+         * Supported formats:
+         *   hms: fixed-width HH:MM:SS.mmmuuunnn
+         *   iso8601: ISO-8601 duration, e.g. PT1H2M3.000004005S
+         *   decimal: plain decimal seconds, e.g. 3723.000004005
+         * @param buf destination buffer. The output is always NUL-terminated if it fits.
+         * @param len size of buf in bytes, including space for the NUL terminator. FORMAT_MAX_LEN is always enough.
+         * @param fmt output format
+         * @returns number of characters written, not counting the NUL terminator, or 0 if buf is too small.
+         */
+        size_t format(char *buf, size_t len, format_t fmt) const;
+        
         /**
          * Convert a PreciseTime object to hours.
          * @param obj the object to convert
@@ -33,35 +53,35 @@ class PreciseTime {
         /**
          * Convert a PreciseTime object to minutes.
          * @param obj the object to convert
-         * @returns value of obj in minutes
+         * @returns value of obj in minutes, or 0xFFFFFFFF if it does not fit in 32 bits
          */
         static uint32_t to_m(PreciseTime obj);
         
         /**
          * Convert a PreciseTime object to seconds.
          * @param obj the object to convert
-         * @returns value of obj in seconds
+         * @returns value of obj in seconds, or 0xFFFFFFFF if it does not fit in 32 bits
          */
         static uint32_t to_s(PreciseTime obj);
         
         /**
          * Convert a PreciseTime object to ms
          * @param obj the object to convert
-         * @returns value of obj in ms
+         * @returns value of obj in ms, or 0xFFFFFFFF if it does not fit in 32 bits
          */
         static uint32_t to_ms(PreciseTime obj);
         
         /**
          * Convert a PreciseTime object to us.
          * @param obj the object to convert
-         * @returns value of obj in us
+         * @returns value of obj in us, or 0xFFFFFFFF if it does not fit in 32 bits
          */
         static uint32_t to_us(PreciseTime obj);
         
         /**
          * Convert a PreciseTime object to ns.
          * @param obj the object to convert
-         * @returns value of obj in ns
+         * @returns value of obj in ns, or 0xFFFFFFFF if it does not fit in 32 bits
          */
         static uint32_t to_ns(PreciseTime obj);
         
@@ -107,6 +127,13 @@ class PreciseTime {
          */
         static PreciseTime from_ns(uint32_t ns);
         
+        /**
+         * Convert a 64-bit number of ns, such as a timer's elapsed time, to a PreciseTime representation.
+         * @param ns number of ns
+         * @returns the PreciseTime representation
+         */
+        static PreciseTime from_ns64(uint64_t ns);
+        
         uint32_t h;
         uint32_t m;
         uint32_t s;
@@ -114,18 +141,39 @@ class PreciseTime {
         uint32_t us;
         uint32_t ns;
         
-        //constants for time conversion since we do not have floating point division
+        //constants for time conversion. All conversions are exact integer arithmetic.
         const static uint32_t NS_PER_US = 1000;
         const static uint32_t US_PER_MS = 1000;
         const static uint32_t MS_PER_SEC = 1000;
         const static uint32_t SEC_PER_MIN = 60;
         const static uint32_t MIN_PER_HOUR = 60;
         
-        const static float US_PER_NS = 0.001;
-        const static float MS_PER_US = 0.001;
-        const static float SEC_PER_MS = 0.001;
-        const static float MIN_PER_SEC = 0.016666666666;
-        const static float HOUR_PER_MIN = 0.016666666666;
+        const static size_t FORMAT_MAX_LEN = 67; //longest possible output of format() or print(), including NUL, even with non-normalized fields
+        
+    private:
+        /**
+         * Writes v in decimal with at least min_digits digits (zero-padded). Values below 1000, which is every
+         * normalized field, take a two-digit table lookup.
+         * @returns pointer just past the last character written
+         */
+        static char *__write_uint(char *dst, uint32_t v, uint8_t min_digits);
+        
+        /**
+         * Writes v in decimal with at least min_digits digits (zero-padded). Only the decimal seconds value needs 64 bits.
+         * @returns pointer just past the last character written
+         */
+        static char *__write_uint64(char *dst, uint64_t v, uint8_t min_digits);
+        
+        /**
+         * Writes the ms, us, and ns fields as nine zero-padded digits.
+         * @returns pointer just past the last character written
+         */
+        char *__write_fraction(char *dst) const;
+        
+        /**
+         * @returns coarse * factor + fine, or 0xFFFFFFFF if that does not fit in 32 bits.
+         */
+        static uint32_t __accumulate(uint32_t coarse, uint32_t factor, uint32_t fine);
 };
 
 #endif
\ No newline at end of file
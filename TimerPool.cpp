@@ -0,0 +1,104 @@
+/* TimerPool.cpp
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "Timer_LPTMR.h"
+#include "Timer_PIT.h"
+#include "Timer_TPM.h"
+#include "TimerPool.h"
+
+TimerPool::TimerPool() {
+    for (uint8_t i = 0; i < NUM_TIMERS; i++) {
+        __slots[i].timer = NULL;
+        __slots[i].in_use = false;
+    }
+    __slots[0].low_power = true; //LPTMR, clocked by MCGIRCLK with IREFSTEN set
+    __slots[1].low_power = false; //PIT
+    __slots[2].low_power = false; //TPM
+}
+
+TimerPool::~TimerPool() {
+    for (uint8_t i = 0; i < NUM_TIMERS; i++) {
+        if (__slots[i].timer != NULL)
+            release(__slots[i].timer);
+    }
+}
+
+HardwareTimer *TimerPool::acquire(uint32_t min_resolution_ns, uint64_t max_period_ns, bool low_power, pool_error_t *error) {
+    bool matched = false;
+
+    for (uint8_t i = 0; i < NUM_TIMERS; i++) {
+        __slot_t *slot = &__slots[i];
+        if (low_power && !slot->low_power)
+            continue;
+
+        if (slot->in_use) {
+            if (__meets(slot->timer, min_resolution_ns, max_period_ns))
+                matched = true;
+            continue;
+        }
+
+        //Construct the timer to check its nominal tick rate. It is not enabled, so its hardware is left untouched.
+        //If someone outside the pool owns the hardware, the new object is invalid, but still describes the timer.
+        HardwareTimer *timer = __create(i);
+        if (timer == NULL)
+            continue;
+
+        if (__meets(timer, min_resolution_ns, max_period_ns)) {
+            matched = true;
+            if (timer->valid()) {
+                slot->timer = timer;
+                slot->in_use = true;
+                if (error != NULL)
+                    *error = ok;
+                return timer;
+            }
+        }
+        delete timer; //do not hold on to hardware we are not handing out
+    }
+
+    if (error != NULL)
+        *error = matched ? busy : no_match;
+    return NULL;
+}
+
+bool TimerPool::release(HardwareTimer *timer) {
+    if (timer == NULL)
+        return false;
+
+    for (uint8_t i = 0; i < NUM_TIMERS; i++) {
+        if (__slots[i].timer == timer) {
+            delete timer; //disables the timer and frees the hardware
+            __slots[i].timer = NULL;
+            __slots[i].in_use = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+HardwareTimer *TimerPool::__create(uint8_t slot) {
+    switch (slot) {
+        case 0:
+            return new Timer_LPTMR();
+        case 1:
+            return new Timer_PIT();
+        case 2:
+            return new Timer_TPM();
+        default:
+            return NULL;
+    }
+}
+
+bool TimerPool::__meets(HardwareTimer *timer, uint32_t min_resolution_ns, uint64_t max_period_ns) {
+    uint64_t hz = timer->tickHz();
+    if (hz == 0)
+        return false;
+
+    bool resolution = (uint64_t) min_resolution_ns * hz >= 1000000000ULL; //tick period <= min_resolution_ns
+    bool range = 4294967296000000000ULL / hz >= max_period_ns; //2^32 ticks, in ns
+    return resolution && range;
+}
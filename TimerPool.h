@@ -0,0 +1,74 @@
+/* TimerPool.h
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef TIMERPOOL_H
+#define TIMERPOOL_H
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+
+/**
+ * Hands out hardware timers by requirement instead of by name. acquire() returns the lowest-power free timer
+ * that meets the requested resolution, range and capabilities, so light jobs do not tie up the high-rate TPM.
+ * Timers are tried in order of power draw: LPTMR (runs from the 32 kHz IRC, keeps running in low-power stop
+ * modes), PIT (bus clock), then TPM (FLL clock).
+ */
+class TimerPool {
+    public:
+        typedef enum {
+            ok,
+            no_match, //no timer can meet the requirements
+            busy //timers that meet the requirements exist, but all are in use
+        } pool_error_t;
+
+        TimerPool();
+
+        /**
+         * Destructs the TimerPool, releasing every timer it handed out.
+         */
+        ~TimerPool();
+
+        /**
+         * Acquires a free timer. The timer is constructed but not enabled. Every timer can make callbacks of any
+         * period (see HardwareTimer::start()), so the range requirement is about getTick(), which wraps after 2^32 ticks.
+         * Timers are judged by their nominal tick rate; the live rate is read from the clock configuration on enable().
+         * @param min_resolution_ns the coarsest acceptable tick period, in ns
+         * @param max_period_ns the longest interval the caller needs to measure with getTick() before it wraps, in ns
+         * @param low_power if true, the timer must keep running in the STOP and VLPS low-power modes
+         * @param error if not NULL, receives ok, or the reason no timer was returned
+         * @returns the timer, or NULL if none is available. Return it with release().
+         */
+        HardwareTimer *acquire(uint32_t min_resolution_ns, uint64_t max_period_ns, bool low_power, pool_error_t *error);
+
+        /**
+         * Disables a timer obtained from acquire() and frees its hardware.
+         * @param timer the timer
+         * @returns true if timer came from this pool.
+         */
+        bool release(HardwareTimer *timer);
+
+        const static uint8_t NUM_TIMERS = 3;
+
+    private:
+        typedef struct {
+            HardwareTimer *timer; //constructed timer, or NULL
+            bool in_use; //handed out by acquire()
+            bool low_power; //keeps running in low-power stop modes
+        } __slot_t;
+
+        /**
+         * Constructs the timer for a slot.
+         */
+        static HardwareTimer *__create(uint8_t slot);
+
+        /**
+         * @returns true if timer meets the tick resolution and getTick() range requirements.
+         */
+        static bool __meets(HardwareTimer *timer, uint32_t min_resolution_ns, uint64_t max_period_ns);
+
+        __slot_t __slots[NUM_TIMERS]; //in order of increasing power draw
+};
+
+#endif
@@ -0,0 +1,339 @@
+/* TimerScheduler.cpp
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "TimerScheduler.h"
+
+#if defined(__cpp_impl_coroutine)
+
+TimerWaiter::TimerWaiter(TimerScheduler *scheduler, TimerEvent *event, uint64_t deadline) :
+                __scheduler(scheduler),
+                __event(event),
+                __deadline(deadline),
+                __handle(),
+                __sleep_next(NULL),
+                __event_next(NULL),
+                __ready_next(NULL),
+                __sleeping(false),
+                __timed_out(false)
+                {}
+
+SleepAwaiter::SleepAwaiter(TimerScheduler *scheduler, uint64_t deadline) :
+                TimerWaiter(scheduler, NULL, deadline)
+                {}
+
+bool SleepAwaiter::await_ready() {
+    return __deadline <= __scheduler->now();
+}
+
+void SleepAwaiter::await_suspend(std::coroutine_handle<> h) {
+    __handle = h;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- the timer ISR walks the sleep list
+    __scheduler->__sleep(this);
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void SleepAwaiter::await_resume() {
+}
+
+EventAwaiter::EventAwaiter(TimerEvent *event) :
+                TimerWaiter(event->__scheduler, event, 0)
+                {}
+
+bool EventAwaiter::await_ready() {
+    return false; //checked in await_suspend(), where it cannot race with set()
+}
+
+bool EventAwaiter::await_suspend(std::coroutine_handle<> h) {
+    __handle = h;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- set() may run from an ISR
+    bool suspend = __event->__wait(this);
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return suspend;
+}
+
+void EventAwaiter::await_resume() {
+}
+
+TimeoutAwaiter::TimeoutAwaiter(TimerEvent *event, uint64_t deadline) :
+                TimerWaiter(event->__scheduler, event, deadline)
+                {}
+
+bool TimeoutAwaiter::await_ready() {
+    return false;
+}
+
+bool TimeoutAwaiter::await_suspend(std::coroutine_handle<> h) {
+    __handle = h;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    bool suspend = __event->__wait(this);
+    if (suspend)
+        __scheduler->__sleep(this);
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return suspend;
+}
+
+bool TimeoutAwaiter::await_resume() {
+    return !__timed_out;
+}
+
+TimerScheduler::TimerScheduler(HardwareTimer *timer) :
+                    __timer(timer),
+                    __sleeping(NULL),
+                    __ready_head(NULL),
+                    __ready_tail(NULL)
+                    {}
+
+TimerScheduler::~TimerScheduler() {
+    stop();
+}
+
+bool TimerScheduler::start(uint32_t check_period) {
+    if (__timer == NULL || !__timer->valid())
+        return false;
+
+    __timer->enable(this, &TimerScheduler::__check);
+    __timer->start(check_period, true, 0);
+    return __timer->running();
+}
+
+void TimerScheduler::stop() {
+    if (__timer != NULL)
+        __timer->disable();
+}
+
+uint32_t TimerScheduler::poll() {
+    uint32_t resumed = 0;
+
+    for (;;) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq(); //CRITICAL SECTION
+        TimerWaiter *w = __ready_head;
+        if (w != NULL) {
+            __ready_head = w->__ready_next;
+            if (__ready_head == NULL)
+                __ready_tail = NULL;
+        }
+        __set_PRIMASK(primask); //END CRITICAL SECTION
+
+        if (w == NULL)
+            break;
+
+        //The waiter lives in the coroutine frame, which may be freed by resume(), so take the handle first
+        std::coroutine_handle<> h = w->__handle;
+        h.resume();
+        resumed++;
+    }
+
+    return resumed;
+}
+
+void TimerScheduler::run() {
+    for (;;) {
+        if (poll() == 0)
+            sleep(); //woken by the next timer check at the latest
+    }
+}
+
+uint64_t TimerScheduler::now() {
+    return __timer->getTick64();
+}
+
+SleepAwaiter TimerScheduler::sleep_for(uint64_t ticks) {
+    return SleepAwaiter(this, now() + ticks);
+}
+
+SleepAwaiter TimerScheduler::sleep_until(uint64_t tick) {
+    return SleepAwaiter(this, tick);
+}
+
+void TimerScheduler::__check() {
+    uint64_t tick = now();
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- TimerEvent::set() may run from a higher-priority ISR
+    while (__sleeping != NULL && __sleeping->__deadline <= tick) {
+        TimerWaiter *w = __sleeping;
+        __sleeping = w->__sleep_next;
+        w->__sleeping = false;
+        w->__timed_out = true;
+        if (w->__event != NULL)
+            w->__event->__unlink(w);
+        __ready(w);
+    }
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void TimerScheduler::__sleep(TimerWaiter *w) {
+    TimerWaiter **p = &__sleeping;
+    while (*p != NULL && (*p)->__deadline <= w->__deadline) //FIFO among equal deadlines
+        p = &(*p)->__sleep_next;
+    w->__sleep_next = *p;
+    *p = w;
+    w->__sleeping = true;
+}
+
+void TimerScheduler::__unsleep(TimerWaiter *w) {
+    TimerWaiter **p = &__sleeping;
+    while (*p != NULL && *p != w)
+        p = &(*p)->__sleep_next;
+    if (*p != NULL)
+        *p = w->__sleep_next;
+    w->__sleeping = false;
+}
+
+void TimerScheduler::__ready(TimerWaiter *w) {
+    w->__ready_next = NULL;
+    if (__ready_tail == NULL)
+        __ready_head = w;
+    else
+        __ready_tail->__ready_next = w;
+    __ready_tail = w;
+}
+
+TimerEvent::TimerEvent(TimerScheduler *scheduler) :
+                __scheduler(scheduler),
+                __waiters(NULL),
+                __set(false)
+                {}
+
+void TimerEvent::set() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    if (__waiters == NULL)
+        __set = true;
+    while (__waiters != NULL) {
+        TimerWaiter *w = __waiters;
+        __waiters = w->__event_next;
+        w->__event = NULL;
+        w->__timed_out = false;
+        if (w->__sleeping)
+            __scheduler->__unsleep(w);
+        __scheduler->__ready(w);
+    }
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+void TimerEvent::reset() {
+    __set = false;
+}
+
+bool TimerEvent::isSet() {
+    return __set;
+}
+
+EventAwaiter TimerEvent::operator co_await() {
+    return EventAwaiter(this);
+}
+
+bool TimerEvent::__wait(TimerWaiter *w) {
+    if (__set) {
+        __set = false;
+        w->__timed_out = false;
+        return false;
+    }
+    w->__event_next = __waiters;
+    __waiters = w;
+    return true;
+}
+
+void TimerEvent::__unlink(TimerWaiter *w) {
+    TimerWaiter **p = &__waiters;
+    while (*p != NULL && *p != w)
+        p = &(*p)->__event_next;
+    if (*p != NULL)
+        *p = w->__event_next;
+    w->__event = NULL;
+}
+
+TimeoutAwaiter with_timeout(TimerEvent &event, uint64_t ticks) {
+    return TimeoutAwaiter(&event, event.__scheduler->now() + ticks);
+}
+
+//Init TimerTask class variables
+TimerTask::__frame_t TimerTask::__arena[TIMER_TASK_POOL_SIZE];
+TimerTask::__frame_t *TimerTask::__free_frames = NULL;
+bool TimerTask::__arena_ready = false;
+
+TimerTask::TimerTask(bool valid) :
+                __valid(valid)
+                {}
+
+bool TimerTask::valid() {
+    return __valid;
+}
+
+uint32_t TimerTask::framesFree() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    uint32_t n = __arena_ready ? 0 : TIMER_TASK_POOL_SIZE;
+    for (__frame_t *f = __free_frames; f != NULL; f = f->next)
+        n++;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return n;
+}
+
+TimerTask TimerTask::promise_type::get_return_object() {
+    return TimerTask(true);
+}
+
+TimerTask TimerTask::promise_type::get_return_object_on_allocation_failure() {
+    return TimerTask(false);
+}
+
+std::suspend_never TimerTask::promise_type::initial_suspend() noexcept {
+    return std::suspend_never();
+}
+
+std::suspend_never TimerTask::promise_type::final_suspend() noexcept {
+    return std::suspend_never(); //the frame is freed as soon as the coroutine returns
+}
+
+void TimerTask::promise_type::return_void() {
+}
+
+void TimerTask::promise_type::unhandled_exception() {
+    error("TimerTask: unhandled exception\r\n");
+}
+
+void *TimerTask::promise_type::operator new(size_t size) noexcept {
+    if (size > TIMER_TASK_FRAME_SIZE)
+        return NULL;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    if (!__arena_ready) { //build the free list on first use rather than relying on static initialization order
+        for (uint32_t i = 0; i < TIMER_TASK_POOL_SIZE; i++)
+            __arena[i].next = (i + 1 < TIMER_TASK_POOL_SIZE) ? &__arena[i + 1] : NULL;
+        __free_frames = &__arena[0];
+        __arena_ready = true;
+    }
+    __frame_t *f = __free_frames;
+    if (f != NULL)
+        __free_frames = f->next;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return f;
+}
+
+void TimerTask::promise_type::operator delete(void *ptr) noexcept {
+    if (ptr == NULL)
+        return;
+
+    __frame_t *f = static_cast<__frame_t *>(ptr);
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION
+    f->next = __free_frames;
+    __free_frames = f;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+}
+
+#endif
@@ -0,0 +1,264 @@
+/* TimerScheduler.h
+ * Target: FRDM-KL46Z (not yet tested on hardware)
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef TIMERSCHEDULER_H
+#define TIMERSCHEDULER_H
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+
+#if defined(__cpp_impl_coroutine) //Requires C++20 coroutines. The rest of the library still builds as C++98.
+#include <coroutine>
+#include <cstddef>
+
+#ifndef TIMER_TASK_POOL_SIZE
+#define TIMER_TASK_POOL_SIZE 16 //maximum number of coroutines alive at once
+#endif
+
+#ifndef TIMER_TASK_FRAME_SIZE
+#define TIMER_TASK_FRAME_SIZE 192 //bytes per coroutine frame. Coroutines with larger frames fail to start.
+#endif
+
+class TimerScheduler;
+class TimerEvent;
+
+/**
+ * Bookkeeping for one suspended coroutine. It lives inside the awaiter, and therefore inside the coroutine frame,
+ * so waiting needs no memory of its own.
+ */
+class TimerWaiter {
+    public:
+        TimerWaiter(TimerScheduler *scheduler, TimerEvent *event, uint64_t deadline);
+
+    protected:
+        friend class TimerScheduler;
+        friend class TimerEvent;
+
+        TimerScheduler *__scheduler;
+        TimerEvent *__event; //event waited on, or NULL
+        uint64_t __deadline; //tick at which the wait times out, if __sleeping
+        std::coroutine_handle<> __handle;
+        TimerWaiter *__sleep_next; //sleep list, sorted by deadline
+        TimerWaiter *__event_next; //waiters on the same event
+        TimerWaiter *__ready_next; //ready list
+        bool __sleeping; //linked into the sleep list
+        bool __timed_out;
+};
+
+/**
+ * Returned by TimerScheduler::sleep_for() and sleep_until(). co_await resumes the coroutine at the deadline.
+ */
+class SleepAwaiter : public TimerWaiter {
+    public:
+        SleepAwaiter(TimerScheduler *scheduler, uint64_t deadline);
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> h);
+        void await_resume();
+};
+
+/**
+ * Returned by co_await on a TimerEvent. Resumes the coroutine when the event is set.
+ */
+class EventAwaiter : public TimerWaiter {
+    public:
+        EventAwaiter(TimerEvent *event);
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> h);
+        void await_resume();
+};
+
+/**
+ * Returned by with_timeout(). co_await resumes the coroutine when the event is set or the timeout expires,
+ * whichever comes first, and yields true if the event was set.
+ */
+class TimeoutAwaiter : public TimerWaiter {
+    public:
+        TimeoutAwaiter(TimerEvent *event, uint64_t deadline);
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> h);
+        bool await_resume();
+};
+
+/**
+ * Runs coroutines that wait on a HardwareTimer. The timer ISR periodically moves coroutines whose deadline has
+ * passed onto a ready list; poll() resumes them from the main loop, so coroutine bodies never run in an ISR.
+ * Waiting coroutines are kept in intrusive lists, so any number can wait without allocation.
+ *
+ * Example:
+ *     TimerTask blink(TimerScheduler &sched, TimerEvent &ack) {
+ *         for (;;) {
+ *             led = !led;
+ *             if (!co_await with_timeout(ack, 48000))
+ *                 retries++;
+ *             co_await sched.sleep_for(480000);
+ *         }
+ *     }
+ */
+class TimerScheduler {
+    public:
+        /**
+         * Constructs a new TimerScheduler.
+         * @param timer the time base. The scheduler takes over its callback.
+         */
+        TimerScheduler(HardwareTimer *timer);
+
+        /**
+         * Destructs the TimerScheduler. The timer is disabled.
+         */
+        ~TimerScheduler();
+
+        /**
+         * Enables and starts the timer.
+         * @param check_period how often to check for expired deadlines, in timer ticks. Sleeps end at most this late.
+         * @returns true on success, false if the timer could not be started.
+         */
+        bool start(uint32_t check_period);
+
+        /**
+         * Stops the timer. Sleeping coroutines stay suspended until the scheduler is started again.
+         */
+        void stop();
+
+        /**
+         * Resumes every ready coroutine. Call this from the main loop.
+         * @returns the number of coroutines resumed.
+         */
+        uint32_t poll();
+
+        /**
+         * Runs poll() forever, sleeping the CPU while no coroutine is ready.
+         */
+        void run();
+
+        /**
+         * @returns the current tick of the timer.
+         */
+        uint64_t now();
+
+        /**
+         * @param ticks number of timer ticks to wait
+         * @returns an awaitable that resumes the coroutine after ticks have elapsed.
+         */
+        SleepAwaiter sleep_for(uint64_t ticks);
+
+        /**
+         * @param tick tick, on the HardwareTimer::getTick64() scale, at which to resume
+         * @returns an awaitable that resumes the coroutine at tick.
+         */
+        SleepAwaiter sleep_until(uint64_t tick);
+
+    private:
+        friend class SleepAwaiter;
+        friend class EventAwaiter;
+        friend class TimeoutAwaiter;
+        friend class TimerEvent;
+
+        /**
+         * Timer callback. Moves expired waiters from the sleep list onto the ready list.
+         */
+        void __check();
+
+        //The following must be called with interrupts disabled
+        void __sleep(TimerWaiter *w);
+        void __unsleep(TimerWaiter *w);
+        void __ready(TimerWaiter *w);
+
+        HardwareTimer *__timer;
+        TimerWaiter *__sleeping; //earliest deadline first
+        TimerWaiter *__ready_head;
+        TimerWaiter *__ready_tail;
+};
+
+/**
+ * An auto-reset event that coroutines can wait on with co_await or with_timeout(). set() may be called from
+ * an interrupt service routine. It wakes every coroutine waiting at the time; if none is waiting, the event stays
+ * set until the next wait, which then completes immediately.
+ */
+class TimerEvent {
+    public:
+        TimerEvent(TimerScheduler *scheduler);
+
+        void set();
+        void reset();
+        bool isSet();
+
+        EventAwaiter operator co_await();
+
+    private:
+        friend class TimerScheduler;
+        friend class EventAwaiter;
+        friend class TimeoutAwaiter;
+        friend TimeoutAwaiter with_timeout(TimerEvent &event, uint64_t ticks);
+
+        /**
+         * Consumes the event if it is set, otherwise links w as a waiter. Must be called with interrupts disabled.
+         * @returns true if w was linked.
+         */
+        bool __wait(TimerWaiter *w);
+        void __unlink(TimerWaiter *w);
+
+        TimerScheduler *__scheduler;
+        TimerWaiter *__waiters;
+        volatile bool __set;
+};
+
+/**
+ * Waits for an event with a time limit.
+ * @param event the event to wait for
+ * @param ticks maximum number of timer ticks to wait
+ * @returns an awaitable that yields true if the event was set, false if the wait timed out.
+ */
+TimeoutAwaiter with_timeout(TimerEvent &event, uint64_t ticks);
+
+/**
+ * Return type of coroutines run by a TimerScheduler. A coroutine starts running as soon as it is called and
+ * frees its frame when it returns. Frames come from a fixed arena of TIMER_TASK_POOL_SIZE blocks of
+ * TIMER_TASK_FRAME_SIZE bytes rather than the heap; if no block is free or the frame is too large, the coroutine
+ * does not start and valid() is false.
+ */
+class TimerTask {
+    public:
+        class promise_type {
+            public:
+                TimerTask get_return_object();
+                static TimerTask get_return_object_on_allocation_failure();
+                std::suspend_never initial_suspend() noexcept;
+                std::suspend_never final_suspend() noexcept;
+                void return_void();
+                void unhandled_exception();
+
+                static void *operator new(size_t size) noexcept;
+                static void operator delete(void *ptr) noexcept;
+        };
+
+        /**
+         * @returns true if the coroutine started.
+         */
+        bool valid();
+
+        /**
+         * @returns the number of unused frames in the arena.
+         */
+        static uint32_t framesFree();
+
+    private:
+        TimerTask(bool valid);
+
+        bool __valid;
+
+        union __frame_t {
+            __frame_t *next;
+            std::max_align_t align;
+            uint8_t bytes[TIMER_TASK_FRAME_SIZE];
+        };
+
+        static __frame_t __arena[TIMER_TASK_POOL_SIZE];
+        static __frame_t *__free_frames;
+        static bool __arena_ready;
+};
+
+#endif
+
+#endif
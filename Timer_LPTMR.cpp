@@ -14,7 +14,7 @@ bool Timer_LPTMR::__lptmr_used = false;
 Timer_LPTMR *Timer_LPTMR::__obj = NULL;
 
 Timer_LPTMR::Timer_LPTMR() :
-        HardwareTimer(0xFFFF, 1, HardwareTimer::ms) //LPTMR has 16-bit counter. And at 1 KHz, each clock cycle is 1 ms
+        HardwareTimer(0x10000, 1, HardwareTimer::ms, LPTimer_IRQn) //LPTMR has 16-bit counter (CMR+1 ticks per rollover). And at 1 KHz, each clock cycle is 1 ms
         {   
     if (__lptmr_used)
         __valid = false;
@@ -27,37 +27,52 @@ Timer_LPTMR::Timer_LPTMR() :
 
 Timer_LPTMR::~Timer_LPTMR() {
     if (__valid) {
+        disable(); //must happen here: the hardware-specific stop is gone by the time ~HardwareTimer() runs
+        __valid = false;
         __lptmr_used = false; //free the hardware LPTMR resource
         __obj = NULL;
     }
 }
 
 uint32_t Timer_LPTMR::getTick() {
+    return (uint32_t) getTick64();
+}
+
+uint64_t Timer_LPTMR::getTick64() {
     if (!__valid)
         return 0;
     
+    uint64_t base;
+    uint32_t period;
     uint16_t ticks;
-    uint32_t count;
+    bool pending;
     
-    //__disable_irq(); //CRITICAL SECTION -- ALL INTERRUPTS MUST BE STOPPED!
-    LPTMR0->CNR = 0; //need to write to the register in order to read it due to buffering
-    ticks = (uint16_t) LPTMR0->CNR;
-    
-    //It is theoretically possible that the timer interrupt is invoked here, between these two lines.
-    //However, the timer doesn't appear to work properly if I put these two in a critical section.
-    
-    count = __count;
-    //__enable_irq(); //END CRITICAL SECTION
+    //If the rollover interrupt updates the base while we read, read again. This avoids a critical section.
+    //A compare match the ISR has not handled yet, because interrupts are masked or we are in an ISR ourselves,
+    //is counted here instead.
+    do {
+        if (__held)
+            return __heldTick; //start() or clockChanged() is rebuilding the counter state
+        base = __tickBase;
+        period = __rolloverValue;
+        LPTMR0->CNR = 0; //need to write to the register in order to read it due to buffering
+        ticks = (uint16_t) LPTMR0->CNR;
+        pending = (LPTMR0->CSR & LPTMR_CSR_TCF_MASK) != 0;
+        if (pending) { //the counter may have reset after the first read
+            LPTMR0->CNR = 0;
+            ticks = (uint16_t) LPTMR0->CNR;
+        }
+    } while (base != __tickBase);
     
     //Convert to ticks
-    return (uint32_t) count * __rolloverValue + ticks;
+    return base + (pending ? period : 0) + ticks;
 }
 
 void Timer_LPTMR::__init_timer() {    
     //MCG clocks  
     MCG->C2 &= ~MCG_C2_IRCS_MASK; //Set slow internal reference clk (32 KHz)
     MCG->C1 |= MCG_C1_IRCLKEN_MASK; //Enable internal reference clk (MCGIRCLK)
-   // MCG->C1 |= MCG_C1_IREFSTEN_MASK; //Enable internal reference clk (MCGIRCLK) to work in stop mode
+    MCG->C1 |= MCG_C1_IREFSTEN_MASK; //Enable internal reference clk (MCGIRCLK) to work in stop mode
     
     //Timer clock gating
     SIM->SCGC5 |= SIM_SCGC5_LPTMR_MASK; //Disable clock gating the timer
@@ -77,23 +92,39 @@ void Timer_LPTMR::__init_timer() {
 }
 
 void Timer_LPTMR::__start_timer() {
-    LPTMR0->CMR = __rolloverValue; //Set the compare register
+    __load_period(__rolloverValue);
     LPTMR0->CSR |= LPTMR_CSR_TIE_MASK; //Enable interrupt
     LPTMR0->CSR |= LPTMR_CSR_TEN_MASK; //Start the timer
 }
 
+void Timer_LPTMR::__load_period(uint32_t ticks) {
+    LPTMR0->CMR = ticks - 1; //Set the compare register. Counter resets on the tick after it matches.
+}
+
 void Timer_LPTMR::__stop_timer() {
-    LPTMR0->CSR = 0; //Reset the LPTMR timer control/status register
+    LPTMR0->CSR = 0; //Reset the LPTMR timer control/status register. Clearing TEN also clears TCF.
+    NVIC_ClearPendingIRQ(LPTimer_IRQn);
+}
+
+uint32_t Timer_LPTMR::__clock_hz() {
+    //LPTMR runs from the slow internal reference clock (32.768 KHz trimmed), divided by 32 in __init_timer().
+    //This is independent of the core clock configuration.
+    return 32768 / 32;
 }
 
 void Timer_LPTMR::__timer_isr() {
+    if (!(LPTMR0->CSR & LPTMR_CSR_TCF_MASK))
+        return; //already counted by a restart
+    
+    //CMR may only be written while TCF is set, so load the next period before clearing the flag
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- getTick64() must see the flag cleared and the base advanced together
+    bool last = __rollover();
     LPTMR0->CSR |= LPTMR_CSR_TCF_MASK;  //Write 1 to TCF to clear the LPT timer compare flag
-    if ((__periodic || __num_callbacks > 0) && __user_fptr != NULL) { //user callback
-        __user_fptr->call();
-        if (!__periodic)
-            __num_callbacks--;
-    }   
-    __count++;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    
+    if (last)
+        __callback();
 }
 
 void Timer_LPTMR::__lptmr_isr_wrapper() {
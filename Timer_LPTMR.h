@@ -17,8 +17,8 @@
 class Timer_LPTMR : public HardwareTimer {
     public:
         /**
-         * Construct a new LPTMR timer. The timer operates at 1 KHz. Only one Timer_LPTMR
-         * object may be valid at a time (can control hardware).
+         * Construct a new LPTMR timer. The timer operates at approximately 1 KHz (32.768 KHz / 32), and keeps running
+         * in the STOP and VLPS low-power modes. Only one Timer_LPTMR object may be valid at a time (can control hardware).
          */
         Timer_LPTMR();
         
@@ -30,11 +30,14 @@ class Timer_LPTMR : public HardwareTimer {
         virtual ~Timer_LPTMR();
 
         virtual uint32_t getTick();
+        virtual uint64_t getTick64();
     
     private:        
         virtual void __init_timer();
         virtual void __start_timer();
         virtual void __stop_timer();
+        virtual uint32_t __clock_hz();
+        virtual void __load_period(uint32_t ticks);
         virtual void __timer_isr();
         
         /** 
@@ -14,7 +14,7 @@ bool Timer_PIT::__pit_used = false;
 Timer_PIT *Timer_PIT::__obj = NULL;
 
 Timer_PIT::Timer_PIT() :
-        HardwareTimer(0xFFFFFFFF, 41.666666666, HardwareTimer::ns) //PIT has 32-bit counter. And at 24 MHz, each clock cycle is 41.666666 ns
+        HardwareTimer(0xFFFFFFFF, 41.666666666, HardwareTimer::ns, PIT_IRQn) //PIT has 32-bit counter. And at 24 MHz, each clock cycle is 41.666666 ns
         {   
     if (__pit_used)
         __valid = false;
@@ -23,33 +23,51 @@ Timer_PIT::Timer_PIT() :
         __pit_used = true;
         __obj = this;
     }
+    __reloadBuffered = true; //LDVAL is only loaded into the counter at the next reload
 }
 
 Timer_PIT::~Timer_PIT() {
     if (__valid) {
+        disable(); //must happen here: the hardware-specific stop is gone by the time ~HardwareTimer() runs
+        __valid = false;
         __pit_used = false; //free the hardware PIT resource
         __obj = NULL;
     }
 }
 
 uint32_t Timer_PIT::getTick() {
+    return (uint32_t) getTick64();
+}
+
+uint64_t Timer_PIT::getTick64() {
     if (!__valid)
         return 0;
-        
+    
+    uint64_t base;
     uint32_t tick;
-    uint32_t count;
-
-    //__disable_irq(); //CRITICAL SECTION -- ALL INTERRUPTS MUST BE STOPPED!
-    tick = PIT->CHANNEL[0].CVAL; //counts down
+    uint32_t period;
+    uint32_t next;
+    bool pending;
     
-    //It is theoretically possible that the timer interrupt is invoked here, between these two lines.
-    //However, the timer doesn't appear to work properly if I put these two in a critical section.
+    //If the rollover interrupt updates the base while we read, read again. This avoids a critical section.
+    //A reload the ISR has not handled yet, because interrupts are masked or we are in an ISR ourselves,
+    //is counted here instead: the counter is then already counting down the next period.
+    do {
+        if (__held)
+            return __heldTick; //start() or clockChanged() is rebuilding the counter state
+        base = __tickBase;
+        period = __rolloverValue;
+        next = __nextRollover;
+        tick = PIT->CHANNEL[0].CVAL; //counts down from period-1
+        pending = (PIT->CHANNEL[0].TFLG & PIT_TFLG_TIF_MASK) != 0;
+        if (pending)
+            tick = PIT->CHANNEL[0].CVAL; //the counter may have reloaded after the first read
+    } while (base != __tickBase);
     
-    count = __count;
-    //__enable_irq(); //END CRITICAL SECTION
-        
     //Convert to ticks
-    return (__rolloverValue - tick) + count * __rolloverValue;
+    if (pending)
+        return base + period + (next - 1 - tick);
+    return base + (period - 1 - tick);
 }
 
 void Timer_PIT::__init_timer() {        
@@ -69,22 +87,43 @@ void Timer_PIT::__init_timer() {
 }
 
 void Timer_PIT::__start_timer() {
-    PIT->CHANNEL[0].LDVAL = __rolloverValue; //Load the countdown value. PIT counts downwards.
-    PIT->CHANNEL[0].TCTRL |= PIT_TCTRL_TEN_MASK; //Enable the timer.
+    __load_period(__rolloverValue);
+    PIT->CHANNEL[0].TCTRL |= PIT_TCTRL_TEN_MASK; //Enable the timer. This reloads the counter from LDVAL.
+}
+
+void Timer_PIT::__load_period(uint32_t ticks) {
+    PIT->CHANNEL[0].LDVAL = ticks - 1; //Load the countdown value. PIT counts downwards, and takes effect at the next reload.
 }
 
 void Timer_PIT::__stop_timer() {
     PIT->CHANNEL[0].TCTRL &= ~PIT_TCTRL_TEN_MASK; //Disable the timer.
+    PIT->CHANNEL[0].TFLG = PIT_TFLG_TIF_MASK; //Clear any reload not yet handled so that a restart does not count it
+    NVIC_ClearPendingIRQ(PIT_IRQn);
+}
+
+uint32_t Timer_PIT::__clock_hz() {
+    return moduleClockHz();
+}
+
+uint32_t Timer_PIT::moduleClockHz() {
+    //PIT runs from the bus clock, which is the core clock divided by OUTDIV4+1
+    SystemCoreClockUpdate();
+    uint32_t outdiv4 = (SIM->CLKDIV1 & SIM_CLKDIV1_OUTDIV4_MASK) >> SIM_CLKDIV1_OUTDIV4_SHIFT;
+    return SystemCoreClock / (outdiv4 + 1);
 }
 
 void Timer_PIT::__timer_isr() {
+    if (!(PIT->CHANNEL[0].TFLG & PIT_TFLG_TIF_MASK))
+        return; //already counted by a restart
+    
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- getTick64() must see the flag cleared and the base advanced together
     PIT->CHANNEL[0].TFLG |= PIT_TFLG_TIF_MASK; //Clear the timer interrupt flag bit
-    if ((__periodic || __num_callbacks > 0) && __user_fptr != NULL) { //user callback
-        __user_fptr->call();
-        if (!__periodic)
-            __num_callbacks--;
-    }   
-    __count++;
+    bool last = __rollover();
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    
+    if (last)
+        __callback();
 }
 
 void Timer_PIT::__pit_isr_wrapper() {
@@ -17,8 +17,8 @@
 class Timer_PIT : public HardwareTimer {
     public:
         /**
-         * Construct a new PIT timer. The timer operates at 1 KHz. Only one Timer_PIT
-         * object may be valid at a time (can control hardware).
+         * Construct a new PIT timer. The timer operates at the bus clock, nominally 24MHz; the actual rate is read
+         * from the clock configuration when enabled. Only one Timer_PIT object may be valid at a time (can control hardware).
          */
         Timer_PIT();
         
@@ -30,11 +30,19 @@ class Timer_PIT : public HardwareTimer {
         virtual ~Timer_PIT();
 
         virtual uint32_t getTick();
+        virtual uint64_t getTick64();
+        
+        /**
+         * @returns the frequency of the bus clock that drives all PIT channels, read from the live clock configuration.
+         */
+        static uint32_t moduleClockHz();
     
     private:        
         virtual void __init_timer();
         virtual void __start_timer();
         virtual void __stop_timer();
+        virtual uint32_t __clock_hz();
+        virtual void __load_period(uint32_t ticks);
         virtual void __timer_isr();
         
         /** 
@@ -8,12 +8,17 @@
 #include "HardwareTimer.h"
 #include "Timer_TPM.h"
 
+#ifndef CPU_XTAL_CLK_HZ
+#define CPU_XTAL_CLK_HZ 8000000 //External crystal on the FRDM-KL46Z
+#endif
+
 //Init Timer_TPM class variables
 bool Timer_TPM::__tpm_used = false;
 Timer_TPM *Timer_TPM::__obj = NULL;
 
 Timer_TPM::Timer_TPM() :
-        HardwareTimer(0xFFFF, 20.833333333, HardwareTimer::ns) //TPM has 16-bit counter. And at 48MHz, each clock cycle is 20.8333333 ns
+        HardwareTimer(0x10000, 20.833333333, HardwareTimer::ns, TPM0_IRQn), //TPM has 16-bit counter (MOD+1 ticks per rollover). And at 48MHz, each clock cycle is 20.8333333 ns
+        __cmod(TPM_SC_CMOD(1))
         {   
     if (__tpm_used)
         __valid = false;
@@ -22,34 +27,194 @@ Timer_TPM::Timer_TPM() :
         __tpm_used = true;
         __obj = this;
     }
+    __reloadBuffered = true; //MOD is only updated when the counter overflows
+    
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        __channels[i].mode = CH_IDLE;
+        __channels[i].level = false;
+        __channels[i].update = false;
+        __channels[i].late = false;
+    }
 }
 
 Timer_TPM::~Timer_TPM() {
     if (__valid) {
+        disable(); //must happen here: the hardware-specific stop is gone by the time ~HardwareTimer() runs
+        __valid = false;
         __tpm_used = false; //free the hardware TPM resource
         __obj = NULL;
     }
 }
 
 uint32_t Timer_TPM::getTick() {
+    return (uint32_t) getTick64();
+}
+
+uint64_t Timer_TPM::getTick64() {
     if (!__valid)
         return 0;
-        
+    
+    uint64_t base;
+    uint32_t period;
     uint16_t tick;
-    uint32_t count;
+    bool pending;
+    
+    //If the overflow interrupt updates the base while we read, read again. This avoids a critical section.
+    //An overflow the ISR has not handled yet, because interrupts are masked or we are in an ISR ourselves,
+    //is counted here instead.
+    do {
+        if (__held)
+            return __heldTick; //start() or clockChanged() is rebuilding the counter state
+        base = __tickBase;
+        period = __rolloverValue;
+        tick = (uint16_t) TPM0->CNT; //Reading is enough. Writing CNT would clear the counter.
+        pending = (TPM0->SC & TPM_SC_TOF_MASK) != 0;
+        if (pending)
+            tick = (uint16_t) TPM0->CNT; //the counter may have wrapped after the first read
+    } while (base != __tickBase);
     
-    //__disable_irq(); //CRITICAL SECTION -- ALL INTERRUPTS MUST BE STOPPED!
-    TPM0->CNT = 0; //Need to write to the TPM CNT register in order to latch current value.
-    tick = (uint16_t) TPM0->CNT; //Value was previously latched, just read it
+    //Convert to ticks
+    return base + (pending ? period : 0) + tick;
+}
 
-    //It is theoretically possible that the timer interrupt is invoked here, between these two lines.
-    //However, the timer doesn't appear to work properly if I put these two in a critical section.
+bool Timer_TPM::scheduleEdge(uint8_t channel, uint64_t tick, edge_t edge) {
+    if (!__valid || !running() || channel >= NUM_CHANNELS)
+        return false;
     
-    count = __count; //Latch current count value.
-    //__enable_irq(); //END CRITICAL SECTION
+    bool ok = true;
     
-    //Convert to ticks
-    return count * __rolloverValue + (uint32_t) tick;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- the overflow ISR arms pending edges
+    
+    volatile __channel_t *ch = &__channels[channel];
+    if (ch->mode == CH_PENDING || ch->mode == CH_PWM || (ch->mode == CH_ARMED && !(TPM0->CONTROLS[channel].CnSC & TPM_CnSC_CHF_MASK)))
+        ok = false; //channel busy
+    else if (tick <= getTick64())
+        ok = false; //too late
+    
+    if (ok) {
+        //Translate toggles into set/clear so that the compare may match again in later periods without effect
+        if (edge == toggle)
+            edge = ch->level ? clear : set;
+        ch->level = (edge == set);
+        
+        uint32_t cnsc = TPM_CnSC_MSA_MASK | TPM_CnSC_ELSB_MASK; //output compare, clear on match
+        if (edge == set)
+            cnsc |= TPM_CnSC_ELSA_MASK; //output compare, set on match
+        
+        ch->late = false;
+        ch->tick = tick;
+        ch->cnsc = cnsc;
+        if (tick < __tickBase + __rolloverValue) { //edge is in this rollover period: arm it right away
+            ch->late = !__arm_edge(channel, (uint16_t) (tick - __tickBase), cnsc);
+            ch->mode = CH_ARMED;
+        } else //overflow ISR arms it when its period begins
+            ch->mode = CH_PENDING;
+    }
+    
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return ok;
+}
+
+bool Timer_TPM::edgeLate(uint8_t channel) {
+    if (channel >= NUM_CHANNELS)
+        return false;
+    return __channels[channel].late;
+}
+
+bool Timer_TPM::edgePending(uint8_t channel) {
+    if (channel >= NUM_CHANNELS)
+        return false;
+    uint8_t mode = __channels[channel].mode;
+    return mode == CH_PENDING || (mode == CH_ARMED && !(TPM0->CONTROLS[channel].CnSC & TPM_CnSC_CHF_MASK));
+}
+
+bool Timer_TPM::startPulseTrain(uint8_t channel, uint32_t period, uint32_t width) {
+    if (!__valid || !enabled() || channel >= NUM_CHANNELS || period == 0 || period > getMaxRolloverTick())
+        return false;
+    
+    if (!running())
+        start(period, true, 0);
+    else if (period != __period)
+        return false;
+    
+    if (width > 0xFFFF)
+        width = 0xFFFF;
+    
+    stopChannel(channel);
+    TPM0->CONTROLS[channel].CnV = width;
+    __set_channel_mode(channel, TPM_CnSC_MSB_MASK | TPM_CnSC_ELSB_MASK); //edge-aligned PWM, high-true pulses
+    __channels[channel].mode = CH_PWM;
+    return true;
+}
+
+bool Timer_TPM::updatePulseTrain(uint8_t channel, uint32_t width) {
+    if (channel >= NUM_CHANNELS || __channels[channel].mode != CH_PWM)
+        return false;
+    
+    if (width > 0xFFFF)
+        width = 0xFFFF;
+    
+    //Hand over to the overflow ISR. Single-byte stores are atomic, and the ISR cannot interrupt itself.
+    __channels[channel].update = false;
+    __channels[channel].value = (uint16_t) width;
+    __channels[channel].update = true;
+    return true;
+}
+
+void Timer_TPM::stopChannel(uint8_t channel) {
+    if (!__valid || !enabled() || channel >= NUM_CHANNELS) //TPM0 may not be clocked yet, and touching it would fault
+        return;
+    
+    __release_channel(channel);
+}
+
+void Timer_TPM::__release_channel(uint8_t channel) {
+    __channels[channel].mode = CH_IDLE;
+    __channels[channel].update = false;
+    __channels[channel].level = false;
+    __channels[channel].late = false;
+    __set_channel_mode(channel, 0);
+    __capture_fptr[channel].attach((void (*)(void)) NULL);
+}
+
+bool Timer_TPM::enableCapture(uint8_t channel, capture_edge_t edge, void (*fptr)(void)) {
+    if (!__valid || !enabled() || channel >= NUM_CHANNELS)
+        return false;
+    
+    __release_channel(channel);
+    __capture_fptr[channel].attach(fptr);
+    return __capture_setup(channel, edge);
+}
+
+uint64_t Timer_TPM::getCaptureTick(uint8_t channel) {
+    if (channel >= NUM_CHANNELS)
+        return 0;
+    
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq(); //CRITICAL SECTION -- 64-bit value written by the ISR
+    uint64_t tick = __channels[channel].capture;
+    __set_PRIMASK(primask); //END CRITICAL SECTION
+    return tick;
+}
+
+void Timer_TPM::setClockSource(clock_source_t source, uint8_t clkin) {
+    if (!__valid)
+        return;
+    
+    if (clkin)
+        SIM->SOPT4 |= SIM_SOPT4_TPM0CLKSEL_MASK; //TPM_CLKIN1
+    else
+        SIM->SOPT4 &= ~SIM_SOPT4_TPM0CLKSEL_MASK; //TPM_CLKIN0
+    
+    __cmod = (source == external_clock) ? TPM_SC_CMOD(2) : TPM_SC_CMOD(1);
+    
+    if (running()) { //The counter must be disabled and the write acknowledged before CMOD can change
+        uint32_t sc = TPM0->SC & ~(TPM_SC_CMOD_MASK | TPM_SC_TOF_MASK);
+        TPM0->SC = sc;
+        while (TPM0->SC & TPM_SC_CMOD_MASK);
+        TPM0->SC = sc | __cmod;
+    }
 }
 
 void Timer_TPM::__init_timer() {    
@@ -64,32 +229,225 @@ void Timer_TPM::__init_timer() {
     
     TPM0->CNT = 0; //Set the count register
     
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) //Release all channels
+        __release_channel(i);
+    
     //Set interrupt handler
     NVIC_SetVector(TPM0_IRQn, (uint32_t) __tpm_isr_wrapper);
     NVIC_EnableIRQ(TPM0_IRQn);
 }
 
 void Timer_TPM::__start_timer() {
-    TPM0->MOD = (uint16_t) __rolloverValue; //Set the modulo register
+    //A restart (start() or clockChanged() on a running timer) moves the counter's origin to __tickBase,
+    //so edges armed against the old origin go back to waiting for their period
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (__channels[i].mode == CH_ARMED && !(TPM0->CONTROLS[i].CnSC & TPM_CnSC_CHF_MASK))
+            __channels[i].mode = CH_PENDING;
+        else if (__channels[i].mode == CH_WAKE) { //delay_ticks() re-arms it if it still needs one
+            __set_channel_mode(i, 0);
+            __channels[i].mode = CH_IDLE;
+        }
+    }
+    
+    TPM0->CNT = 0; //Writing any value clears the counter
+    __load_period(__rolloverValue); //Counter is stopped, so this takes effect immediately
     TPM0->SC |= TPM_SC_TOIE_MASK; //Enable interrupt
-    TPM0->SC |= TPM_SC_CMOD(1); //Start the timer. Timer will increment on the TPM clock edges, not an external clock
+    TPM0->SC |= __cmod; //Start the timer. Timer will increment on the TPM clock edges, or the external clock if selected
+    
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) { //Arm pending edges that fall in the first period
+        volatile __channel_t *ch = &__channels[i];
+        if (ch->mode == CH_PENDING && ch->tick < __tickBase + __rolloverValue) {
+            ch->late = !__arm_edge(i, (uint16_t) (ch->tick > __tickBase ? ch->tick - __tickBase : 0), ch->cnsc);
+            ch->mode = CH_ARMED;
+        }
+    }
+}
+
+void Timer_TPM::__load_period(uint32_t ticks) {
+    TPM0->MOD = (uint16_t) (ticks - 1); //Set the modulo register. While counting, takes effect at the next overflow.
+}
+
+bool Timer_TPM::__arm_wake(uint64_t tick) {
+    if (tick >= __tickBase + __rolloverValue || tick <= getTick64())
+        return false; //the overflow interrupt comes first anyway, or the tick has passed
+    
+    //Reuse the channel armed by an earlier call, else take the highest free one, as applications tend to use the low ones
+    int8_t channel = -1;
+    for (int8_t i = NUM_CHANNELS - 1; i >= 0; i--) {
+        if (__channels[i].mode == CH_WAKE) {
+            channel = i;
+            break;
+        }
+        if (channel < 0 && __channels[i].mode == CH_IDLE)
+            channel = i;
+    }
+    if (channel < 0)
+        return false;
+    
+    uint16_t cnv = (uint16_t) (tick - __tickBase);
+    TPM0->CONTROLS[channel].CnSC |= TPM_CnSC_CHF_MASK; //clear a stale match flag before the new mode can set one
+    TPM0->CONTROLS[channel].CnV = cnv;
+    __set_channel_mode(channel, TPM_CnSC_CHIE_MASK | TPM_CnSC_MSA_MASK); //software compare: interrupt only, pin untouched
+    if ((uint16_t) TPM0->CNT >= cnv && !(TPM0->CONTROLS[channel].CnSC & TPM_CnSC_CHF_MASK)) {
+        //The counter passed the tick while the channel was set up, so the compare would only match next period
+        __set_channel_mode(channel, 0);
+        __channels[channel].mode = CH_IDLE;
+        return false;
+    }
+    __channels[channel].mode = CH_WAKE;
+    return true;
 }
 
 void Timer_TPM::__stop_timer() {
-    TPM0->SC = 0; //Reset TPM
+    TPM0->SC = TPM_SC_TOF_MASK; //Reset TPM, clearing any overflow not yet handled so that a restart does not count it
+    NVIC_ClearPendingIRQ(TPM0_IRQn);
+}
+
+uint32_t Timer_TPM::__clock_hz() {
+    return moduleClockHz();
+}
+
+uint32_t Timer_TPM::moduleClockHz() {
+    //TPM runs from MCGFLLCLK, or MCGPLLCLK/2 if PLLFLLSEL is set (see __init_timer()). Prescaler is 1.
+    SystemCoreClockUpdate();
+    uint32_t outdiv1 = (SIM->CLKDIV1 & SIM_CLKDIV1_OUTDIV1_MASK) >> SIM_CLKDIV1_OUTDIV1_SHIFT;
+    uint32_t mcgout = SystemCoreClock * (outdiv1 + 1);
+    uint8_t clkst = (MCG->S & MCG_S_CLKST_MASK) >> MCG_S_CLKST_SHIFT;
+    
+    if (SIM->SOPT2 & SIM_SOPT2_PLLFLLSEL_MASK)
+        return mcgout / 2; //PLL engaged (PEE)
+    if (clkst == 0)
+        return mcgout; //FLL engaged (FEI/FEE)
+    
+    //MCGOUTCLK bypasses the FLL (FBI/FBE/BLPx), so compute the FLL output from its reference and multiplier
+    uint32_t ref;
+    if (MCG->C1 & MCG_C1_IREFS_MASK)
+        ref = 32768; //slow internal reference
+    else {
+        uint8_t frdiv = (MCG->C1 & MCG_C1_FRDIV_MASK) >> MCG_C1_FRDIV_SHIFT;
+        ref = CPU_XTAL_CLK_HZ;
+        if (MCG->C2 & MCG_C2_RANGE0_MASK) { //high-frequency range divides by a further 32
+            if (frdiv == 6)
+                ref /= 1280;
+            else if (frdiv == 7)
+                ref /= 1536;
+            else
+                ref >>= 5 + frdiv;
+        } else
+            ref >>= frdiv;
+    }
+    
+    static const uint16_t fll_factor[2][4] = { {640, 1280, 1920, 2560}, {732, 1464, 2197, 2929} };
+    uint8_t dmx32 = (MCG->C4 & MCG_C4_DMX32_MASK) ? 1 : 0;
+    uint8_t drs = (MCG->C4 & MCG_C4_DRST_DRS_MASK) >> MCG_C4_DRST_DRS_SHIFT;
+    return ref * fll_factor[dmx32][drs];
 }
 
 void Timer_TPM::__timer_isr() {
-    TPM0->SC |= TPM_SC_TOF_MASK;
-    TPM0->MOD = (uint16_t) __rolloverValue; //Set the modulo register
-    if ((__periodic || __num_callbacks > 0) && __user_fptr != NULL) { //user callback
-        __user_fptr->call();
-        if (!__periodic)
-            __num_callbacks--;
-    }   
-    __count++;
+    //The TPM0 interrupt is shared by the counter overflow and the channels
+    uint32_t status = TPM0->STATUS;
+    bool overflow = (status & TPM_STATUS_TOF_MASK) != 0;
+    uint64_t base = __tickBase; //start of the period before any overflow handled below
+    uint32_t period = __rolloverValue;
+    bool last = false;
+    
+    if (overflow) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq(); //CRITICAL SECTION -- getTick64() must see the flag cleared and the base advanced together
+        TPM0->SC |= TPM_SC_TOF_MASK;
+        last = __rollover();
+        __set_PRIMASK(primask); //END CRITICAL SECTION
+        
+        //Arm output edges that fall in the period that just began, and latch new pulse widths
+        for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+            volatile __channel_t *ch = &__channels[i];
+            if (ch->mode == CH_PENDING && ch->tick < __tickBase + __rolloverValue) {
+                ch->late = !__arm_edge(i, (uint16_t) (ch->tick - __tickBase), ch->cnsc);
+                ch->mode = CH_ARMED;
+            } else if (ch->mode == CH_PWM && ch->update) {
+                TPM0->CONTROLS[i].CnV = ch->value; //buffered by the hardware until the next overflow
+                ch->update = false;
+            }
+        }
+    }
+    
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++) {
+        if (!(status & (TPM_STATUS_CH0F_MASK << i)))
+            continue;
+        
+        //Wake-up compares are one-shot: the interrupt itself was all delay_ticks() needed
+        if (__channels[i].mode == CH_WAKE) {
+            __set_channel_mode(i, 0);
+            TPM0->CONTROLS[i].CnSC |= TPM_CnSC_CHF_MASK;
+            __channels[i].mode = CH_IDLE;
+            continue;
+        }
+        
+        //Input captures
+        if (__channels[i].mode != CH_CAPTURE)
+            continue;
+        
+        uint32_t value = TPM0->CONTROLS[i].CnV;
+        TPM0->CONTROLS[i].CnSC |= TPM_CnSC_CHF_MASK; //clear the capture flag
+        
+        //If an overflow was pending too, a small capture value was taken after it
+        if (overflow && value < period / 2)
+            __channels[i].capture = __tickBase + value;
+        else
+            __channels[i].capture = base + value;
+        __capture_fptr[i].call();
+    }
+    
+    if (last)
+        __callback();
 }
 
 void Timer_TPM::__tpm_isr_wrapper() {
     __obj->__timer_isr();   
-}
\ No newline at end of file
+}
+
+bool Timer_TPM::__arm_edge(uint8_t channel, uint16_t cnv, uint32_t cnsc) {
+    TPM0->CONTROLS[channel].CnSC |= TPM_CnSC_CHF_MASK; //clear a stale match flag before the new mode can set one
+    TPM0->CONTROLS[channel].CnV = cnv;
+    __set_channel_mode(channel, cnsc);
+    
+    //The counter keeps running while the channel is set up. If it has already passed cnv without a match, the compare
+    //would only fire a whole period late. Move it just ahead of the counter instead, further each time we lose the race.
+    bool on_time = true;
+    uint32_t margin = EDGE_REARM_TICKS;
+    uint16_t cnt;
+    while ((cnt = (uint16_t) TPM0->CNT) >= cnv && !(TPM0->CONTROLS[channel].CnSC & TPM_CnSC_CHF_MASK)) {
+        on_time = false;
+        if (cnt + margin >= __rolloverValue) { //too close to the end of the period: match at 0, just after the overflow
+            TPM0->CONTROLS[channel].CnV = 0;
+            break;
+        }
+        cnv = (uint16_t) (cnt + margin);
+        TPM0->CONTROLS[channel].CnV = cnv;
+        margin *= 2;
+    }
+    return on_time;
+}
+
+bool Timer_TPM::__capture_setup(uint8_t channel, capture_edge_t edge) {
+    uint32_t cnsc = TPM_CnSC_CHIE_MASK; //input capture with channel interrupt
+    if (edge == rising || edge == both)
+        cnsc |= TPM_CnSC_ELSA_MASK;
+    if (edge == falling || edge == both)
+        cnsc |= TPM_CnSC_ELSB_MASK;
+    
+    __channels[channel].capture = 0;
+    __set_channel_mode(channel, cnsc);
+    TPM0->CONTROLS[channel].CnSC |= TPM_CnSC_CHF_MASK; //clear stale capture flag
+    __channels[channel].mode = CH_CAPTURE;
+    return true;
+}
+
+void Timer_TPM::__set_channel_mode(uint8_t channel, uint32_t cnsc) {
+    const uint32_t mode_mask = TPM_CnSC_MSA_MASK | TPM_CnSC_MSB_MASK | TPM_CnSC_ELSA_MASK | TPM_CnSC_ELSB_MASK;
+    
+    TPM0->CONTROLS[channel].CnSC = 0;
+    while (TPM0->CONTROLS[channel].CnSC & mode_mask); //wait for acknowledgement
+    TPM0->CONTROLS[channel].CnSC = cnsc;
+    while ((TPM0->CONTROLS[channel].CnSC & mode_mask) != (cnsc & mode_mask));
+}
@@ -16,9 +16,26 @@
  */
 class Timer_TPM : public HardwareTimer {
     public:
+        typedef enum {
+            toggle,
+            clear,
+            set
+        } edge_t;
+        
+        typedef enum {
+            rising,
+            falling,
+            both
+        } capture_edge_t;
+        
+        typedef enum {
+            internal_clock,
+            external_clock
+        } clock_source_t;
+        
         /**
-         * Construct a new TPM timer. The timer operates at 48MHz. Only one Timer_TPM
-         * object may be valid at a time (can control hardware).
+         * Construct a new TPM timer. The timer operates at the FLL clock, nominally 48MHz; the actual rate is read
+         * from the clock configuration when enabled. Only one Timer_TPM object may be valid at a time (can control hardware).
          */
         Timer_TPM();
         
@@ -30,11 +47,114 @@ class Timer_TPM : public HardwareTimer {
         virtual ~Timer_TPM();
 
         virtual uint32_t getTick();
+        virtual uint64_t getTick64();
+        
+        /**
+         * Schedules a single output edge on a TPM0 channel pin in hardware output-compare mode, so the edge
+         * is exact to the tick and needs no CPU work when it happens. The timer must be running. The caller must
+         * route the channel to a pin beforehand (PORTx->PCR[n] = PORT_PCR_MUX(k)).
+         * Each channel holds one edge at a time. Toggle edges assume that the output starts low.
+         * Edges that fall in a later rollover period are armed from the overflow ISR. If the counter has already passed
+         * the edge's tick by the time the channel is armed (an edge within the interrupt latency of the period start, or
+         * one scheduled only a few ticks ahead), the compare is moved to just ahead of the counter, so the edge happens
+         * a few ticks late rather than a whole period late. edgeLate() reports this.
+         * @param channel TPM0 channel, 0 to NUM_CHANNELS-1
+         * @param tick absolute tick, as returned by getTick64(), at which the edge occurs
+         * @param edge what the edge does to the output
+         * @returns true if the edge was scheduled, false if the tick has already passed, the channel still has an
+         * edge that has not happened yet, or the channel is generating a pulse train.
+         */
+        bool scheduleEdge(uint8_t channel, uint64_t tick, edge_t edge);
+        
+        /**
+         * @returns true if the edge last scheduled on channel has not happened yet.
+         */
+        bool edgePending(uint8_t channel);
+        
+        /**
+         * @returns true if the edge last scheduled on channel was armed after its tick had passed, so it happened late.
+         */
+        bool edgeLate(uint8_t channel);
+        
+        /**
+         * Generates a pulse train on a TPM0 channel pin in edge-aligned PWM mode. The output goes high at each
+         * rollover and low width ticks later. All channels share the TPM counter, so the period is the timer
+         * rollover period: if the timer is already running, period must equal the value passed to start(); otherwise
+         * the timer is started with this period. The caller must route the channel to a pin beforehand.
+         * @param channel TPM0 channel, 0 to NUM_CHANNELS-1
+         * @param period pulse period in ticks
+         * @param width pulse width in ticks. 0 keeps the output low, period or more keeps it high.
+         * @returns true if the pulse train was started.
+         */
+        bool startPulseTrain(uint8_t channel, uint32_t period, uint32_t width);
+        
+        /**
+         * Changes the width of a running pulse train. The new width is written from the overflow ISR and takes
+         * effect at a period boundary, so no runt or stretched pulses are produced.
+         * @param channel TPM0 channel, 0 to NUM_CHANNELS-1
+         * @param width new pulse width in ticks
+         * @returns true if the channel is generating a pulse train.
+         */
+        bool updatePulseTrain(uint8_t channel, uint32_t width);
+        
+        /**
+         * Stops any edge or pulse train on a channel and releases its pin from the TPM. Does nothing unless the timer
+         * is enabled, since TPM0 may not be clocked before that; enable() releases every channel anyway.
+         * @param channel TPM0 channel, 0 to NUM_CHANNELS-1
+         */
+        void stopChannel(uint8_t channel);
+        
+        /**
+         * Timestamps edges on a TPM0 channel pin in hardware input-capture mode. The user callback is called from the
+         * timer ISR after each capture; it can read the timestamp with getCaptureTick(). The caller must route the
+         * channel to a pin beforehand. The timer must be enabled.
+         * @param channel TPM0 channel, 0 to NUM_CHANNELS-1
+         * @param edge which input edges to capture
+         * @param fptr the user callback function, or NULL for none
+         * @returns true if capture was enabled.
+         */
+        bool enableCapture(uint8_t channel, capture_edge_t edge, void (*fptr)(void));
+        
+        /**
+         * Timestamps edges on a TPM0 channel pin in hardware input-capture mode. See enableCapture() above.
+         * @param channel TPM0 channel, 0 to NUM_CHANNELS-1
+         * @param edge which input edges to capture
+         * @param tptr the object
+         * @param mptr method to call on the object
+         * @returns true if capture was enabled.
+         */
+        template<typename T> bool enableCapture(uint8_t channel, capture_edge_t edge, T *tptr, void (T::*mptr)(void));
+        
+        /**
+         * @param channel TPM0 channel, 0 to NUM_CHANNELS-1
+         * @returns the 64-bit tick, on the getTick64() scale, of the most recent capture on channel.
+         */
+        uint64_t getCaptureTick(uint8_t channel);
+        
+        /**
+         * Selects what the TPM counter counts. With external_clock, the counter increments on rising edges of the
+         * TPM_CLKINx pin instead of the 48 MHz TPM clock, so ticks are input edges and getTime() is meaningless.
+         * The external clock must be slower than a quarter of the TPM clock. The caller must route the pin beforehand.
+         * May be called while the timer is running.
+         * @param source internal_clock (default) or external_clock
+         * @param clkin which TPM_CLKIN pin to use with external_clock, 0 or 1
+         */
+        void setClockSource(clock_source_t source, uint8_t clkin);
+        
+        /**
+         * @returns the frequency of the TPM module clock shared by TPM0-2, read from the live clock configuration.
+         */
+        static uint32_t moduleClockHz();
+        
+        const static uint8_t NUM_CHANNELS = 6;
     
     private:        
         virtual void __init_timer();
         virtual void __start_timer();
         virtual void __stop_timer();
+        virtual uint32_t __clock_hz();
+        virtual void __load_period(uint32_t ticks);
+        virtual bool __arm_wake(uint64_t tick);
         virtual void __timer_isr();
         
         /** 
@@ -43,9 +163,63 @@ class Timer_TPM : public HardwareTimer {
          * we need to wrap it instead.
          */
         static void __tpm_isr_wrapper();
+        
+        /**
+         * Changes the mode of a channel. The TPM requires the channel to be disabled and the write acknowledged
+         * before a new mode is written.
+         */
+        static void __set_channel_mode(uint8_t channel, uint32_t cnsc);
+        
+        /**
+         * Programs an output compare at cnv. If the counter passed cnv before the compare took effect, the compare is
+         * moved just ahead of the counter.
+         * @returns true if the compare was armed in time
+         */
+        bool __arm_edge(uint8_t channel, uint16_t cnv, uint32_t cnsc);
+        
+        /**
+         * Stops a channel and forgets what it was doing. The caller must make sure TPM0 is clocked.
+         */
+        void __release_channel(uint8_t channel);
+        
+        bool __capture_setup(uint8_t channel, capture_edge_t edge);
+        
+        typedef struct {
+            uint8_t mode; //what the channel is doing
+            bool level; //output level after the last scheduled edge
+            uint64_t tick; //absolute tick of a pending edge
+            uint16_t value; //new width of a pulse train
+            uint32_t cnsc; //channel mode of a pending edge
+            bool update; //pulse train width must be written
+            bool late; //the last edge was armed after its tick had passed
+            uint64_t capture; //tick of the last input capture
+        } __channel_t;
+        
+        volatile __channel_t __channels[NUM_CHANNELS];
+        FunctionPointer __capture_fptr[NUM_CHANNELS]; //User input capture callbacks
+        uint32_t __cmod; //counter clock mode used when the timer runs
+        
+        const static uint8_t CH_IDLE = 0;
+        const static uint8_t CH_PENDING = 1; //edge waits for its rollover period
+        const static uint8_t CH_ARMED = 2; //edge is programmed into the hardware
+        const static uint8_t CH_PWM = 3;
+        const static uint8_t CH_CAPTURE = 4;
+        const static uint8_t CH_WAKE = 5; //software compare that wakes delay_ticks()
+        
+        const static uint8_t EDGE_REARM_TICKS = 8; //first margin ahead of the counter when an edge was armed too late
                 
         static bool __tpm_used; //This flag ensures that no two Timer_TPM objects attempt to manipulate the hardware at once
         static Timer_TPM *__obj; //if __tpm_used is true, this should point to the valid Timer_TPM object. This helps with the ISR wrapper.
 };
 
-#endif
\ No newline at end of file
+template <typename T> bool Timer_TPM::enableCapture(uint8_t channel, capture_edge_t edge, T *tptr, void (T::*mptr)(void)) {
+    if (!__valid || !enabled() || channel >= NUM_CHANNELS)
+        return false;
+    
+    __release_channel(channel);
+    if (tptr != NULL && mptr != NULL)
+        __capture_fptr[channel].attach(tptr, mptr);
+    return __capture_setup(channel, edge);
+}
+
+#endif
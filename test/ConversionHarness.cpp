@@ -0,0 +1,465 @@
+/* ConversionHarness.cpp
+ * Host-run regression harness for the PreciseTime conversions and HardwareTimer::getElapsedNs()/getTime().
+ * Every conversion is checked against exact 128-bit reference arithmetic, exhaustively over boundary ranges and by
+ * randomised sampling. The maximum error and the throughput of each conversion are reported, and the exit status
+ * is non-zero if any result is wrong or any conversion is not clearly faster than a double-precision reference
+ * timed in the same run.
+ *
+ * Usage: ConversionHarness [--samples N] [--seed S] [--no-throughput]
+ *
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "PreciseTime.h"
+#include "HardwareTimer.h"
+#include "FakeTimer.h"
+#include <time.h>
+#include <math.h>
+
+typedef unsigned __int128 uint128_t;
+
+//Units in PreciseTime field order, coarsest first
+#define NUM_UNITS 6
+static const char *unit_names[NUM_UNITS] = { "h", "m", "s", "ms", "us", "ns" };
+static const uint64_t ns_per_unit[NUM_UNITS] = { 3600000000000ULL, 60000000000ULL, 1000000000ULL, 1000000ULL, 1000ULL, 1ULL };
+static const uint32_t field_limit[NUM_UNITS] = { 0xFFFFFFFF, 60, 60, 1000, 1000, 1000 }; //normalized fields are below this
+
+typedef PreciseTime (*from_fn_t)(uint32_t);
+typedef uint32_t (*to_fn_t)(PreciseTime);
+
+static const from_fn_t from_fn[NUM_UNITS] = {
+    PreciseTime::from_h, PreciseTime::from_m, PreciseTime::from_s,
+    PreciseTime::from_ms, PreciseTime::from_us, PreciseTime::from_ns
+};
+static const to_fn_t to_fn[NUM_UNITS] = {
+    PreciseTime::to_h, PreciseTime::to_m, PreciseTime::to_s,
+    PreciseTime::to_ms, PreciseTime::to_us, PreciseTime::to_ns
+};
+
+//Tick rates of the KL46Z timers: LPTMR (1 kHz LPO and 32 kHz), default FLL, bus and core clocks, and an awkward prime
+#define NUM_RATES 6
+static const uint32_t tick_rates[NUM_RATES] = { 1024, 32768, 1000003, 20971520, 24000000, 48000000 };
+
+/**
+ * Result of one conversion under test.
+ */
+typedef struct {
+    char name[24];
+    uint64_t checks;
+    uint64_t mismatches;
+    uint128_t max_error; //in ns for from_*(), getElapsedNs() and getTime(), otherwise in the unit of the result
+} stat_t;
+
+static stat_t from_stats[NUM_UNITS];
+static stat_t to_stats[NUM_UNITS];
+static stat_t elapsed_stats;
+static stat_t gettime_stats;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+/**
+ * xorshift64*: fast and reproducible for a given --seed.
+ */
+static uint64_t rand64() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t rand32() {
+    return (uint32_t) (rand64() >> 32);
+}
+
+static void stat_init(stat_t *st, const char *name) {
+    snprintf(st->name, sizeof(st->name), "%s", name);
+    st->checks = 0;
+    st->mismatches = 0;
+    st->max_error = 0;
+}
+
+static void stat_add(stat_t *st, uint128_t got, uint128_t ref, bool ok) {
+    uint128_t err = got > ref ? got - ref : ref - got;
+    st->checks++;
+    if (err != 0 || !ok) {
+        if (st->mismatches < 5)
+            fprintf(stderr, "MISMATCH %s: got %llu, expected %llu\n", st->name,
+                    (unsigned long long) got, (unsigned long long) ref);
+        st->mismatches++;
+    }
+    if (err > st->max_error)
+        st->max_error = err;
+}
+
+static uint32_t saturate(uint128_t v) {
+    return v > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) v;
+}
+
+/**
+ * @returns the total of all fields of t in nanoseconds, without overflow
+ */
+static uint128_t total_ns(const PreciseTime &t) {
+    const uint32_t f[NUM_UNITS] = { t.h, t.m, t.s, t.ms, t.us, t.ns };
+    uint128_t total = 0;
+    for (uint8_t i = 0; i < NUM_UNITS; i++)
+        total += (uint128_t) f[i] * ns_per_unit[i];
+    return total;
+}
+
+/**
+ * @returns true if every field of t is below its limit
+ */
+static bool normalized(const PreciseTime &t) {
+    const uint32_t f[NUM_UNITS] = { t.h, t.m, t.s, t.ms, t.us, t.ns };
+    for (uint8_t i = 1; i < NUM_UNITS; i++) {
+        if (f[i] >= field_limit[i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Checks to_*() on an arbitrary, possibly non-normalized, object. to_X() adds up the fields from h down to X and
+ * saturates at 0xFFFFFFFF; finer fields are ignored. For a normalized object this is the exact floor of the total.
+ */
+static void check_to(const PreciseTime &t) {
+    const uint32_t f[NUM_UNITS] = { t.h, t.m, t.s, t.ms, t.us, t.ns };
+    for (uint8_t w = 0; w < NUM_UNITS; w++) {
+        uint128_t ref = 0;
+        for (uint8_t i = 0; i <= w; i++)
+            ref += (uint128_t) f[i] * (ns_per_unit[i] / ns_per_unit[w]);
+        stat_add(&to_stats[w], to_fn[w](t), saturate(ref), true);
+    }
+}
+
+/**
+ * Checks that from_u(v) is normalized and totals exactly v * ns_per_unit[u], and each to_*() of the result against
+ * the exact floor of that total.
+ */
+static void check_from(uint8_t u, uint32_t v) {
+    PreciseTime t = from_fn[u](v);
+    uint128_t ref = (uint128_t) v * ns_per_unit[u];
+    stat_add(&from_stats[u], total_ns(t), ref, normalized(t));
+    for (uint8_t w = 0; w < NUM_UNITS; w++)
+        stat_add(&to_stats[w], to_fn[w](t), saturate(ref / ns_per_unit[w]), true);
+}
+
+/**
+ * Checks getElapsedNs() and getTime() at one tick count against floor(tick * 1e9 / hz).
+ */
+static void check_tick(FakeTimer *timer, uint32_t hz, uint64_t tick) {
+    timer->setTick(tick);
+    uint128_t ref = (uint128_t) tick * 1000000000ULL / hz;
+    stat_add(&elapsed_stats, timer->getElapsedNs(), ref, true);
+
+    PreciseTime t = timer->getTime();
+    stat_add(&gettime_stats, total_ns(t), ref, normalized(t));
+}
+
+/**
+ * Checks that start() carries the tick count over from a running counter, and that the first start() begins at
+ * zero rather than at whatever the stopped counter reads.
+ * @returns true if both starts kept the tick count
+ */
+static bool check_start() {
+    FakeTimer timer(1000);
+    timer.start(1000, true, 0);
+    bool first = timer.getTick64() == 0 && timer.getElapsedNs() == 0;
+
+    timer.setTick(5000);
+    timer.start(2000, true, 0);
+    bool restart = timer.getTick64() == 5000 && timer.getElapsedNs() == 5000000000ULL;
+
+    printf("start()        first %s, restart %s\n\n", first ? "from 0" : "JUMPED", restart ? "continuous" : "JUMPED");
+    return first && restart;
+}
+
+/**
+ * Runs the exact checks.
+ * @param samples number of random samples per conversion
+ */
+static void run_checks(uint64_t samples) {
+    char name[24];
+    for (uint8_t u = 0; u < NUM_UNITS; u++) {
+        snprintf(name, sizeof(name), "from_%s", unit_names[u]);
+        stat_init(&from_stats[u], name);
+        snprintf(name, sizeof(name), "to_%s", unit_names[u]);
+        stat_init(&to_stats[u], name);
+    }
+    stat_init(&elapsed_stats, "getElapsedNs");
+    stat_init(&gettime_stats, "getTime");
+
+    //Every ratio between two units, and every input at which a to_*() of a from_*() starts to saturate
+    uint64_t edges[64];
+    uint8_t num_edges = 0;
+    for (uint8_t i = 0; i < NUM_UNITS; i++) {
+        for (uint8_t j = i + 1; j < NUM_UNITS; j++) {
+            uint64_t ratio = ns_per_unit[i] / ns_per_unit[j];
+            if (ratio <= 0xFFFFFFFF) {
+                edges[num_edges++] = ratio;
+                edges[num_edges++] = 0xFFFFFFFFULL / ratio;
+            }
+        }
+    }
+
+    //Boundary ranges: the bottom and top of the input range, and a band around multiples of every edge
+    for (uint8_t u = 0; u < NUM_UNITS; u++) {
+        for (uint32_t v = 0; v < 200000; v++)
+            check_from(u, v);
+        for (uint32_t v = 0; v < 100000; v++)
+            check_from(u, 0xFFFFFFFF - v);
+        for (uint8_t e = 0; e < num_edges; e++) {
+            for (uint64_t k = 1; k <= 2000 && k * edges[e] <= 0xFFFFFFFFULL + 2; k++) {
+                for (int64_t d = -2; d <= 2; d++) {
+                    uint64_t v = k * edges[e] + d;
+                    if (v <= 0xFFFFFFFF)
+                        check_from(u, (uint32_t) v);
+                }
+            }
+        }
+    }
+
+    //Randomised sampling. Inputs are spread over all magnitudes, not just near 2^32.
+    for (uint64_t n = 0; n < samples; n++) {
+        for (uint8_t u = 0; u < NUM_UNITS; u++)
+            check_from(u, rand32() >> (rand32() % 32));
+    }
+
+    //to_*() of non-normalized objects, which exercises the saturating accumulation. Each field is zero, in range,
+    //or anywhere up to 2^32 - 1.
+    for (uint64_t n = 0; n < samples; n++) {
+        PreciseTime t;
+        uint32_t *f[NUM_UNITS] = { &t.h, &t.m, &t.s, &t.ms, &t.us, &t.ns };
+        for (uint8_t i = 0; i < NUM_UNITS; i++) {
+            switch (rand32() % 4) {
+                case 0:
+                    *f[i] = 0;
+                    break;
+                case 1:
+                    *f[i] = rand32() % field_limit[i];
+                    break;
+                case 2:
+                    *f[i] = rand32() >> (rand32() % 32);
+                    break;
+                default:
+                    *f[i] = rand32();
+                    break;
+            }
+        }
+        check_to(t);
+    }
+
+    //getElapsedNs() and getTime() at each tick rate, up to 2^32 seconds
+    for (uint8_t r = 0; r < NUM_RATES; r++) {
+        uint32_t hz = tick_rates[r];
+        uint64_t max_tick = ((uint64_t) hz << 32) - 1;
+        FakeTimer timer(hz);
+
+        for (uint64_t tick = 0; tick < 100000; tick++)
+            check_tick(&timer, hz, tick);
+        for (uint64_t tick = 0; tick < 100000; tick++)
+            check_tick(&timer, hz, max_tick - tick);
+        for (uint64_t k = 1; k <= 20000; k++) {
+            for (int64_t d = -2; d <= 2; d++) {
+                check_tick(&timer, hz, k * hz + d); //second boundaries
+                check_tick(&timer, hz, k * 3600 * (uint64_t) hz + d); //hour boundaries
+            }
+        }
+        for (uint64_t n = 0; n < samples; n++)
+            check_tick(&timer, hz, (rand64() >> (rand32() % 64)) % (max_tick + 1));
+    }
+}
+
+/**
+ * Minimum throughput of each conversion, as a multiple of the same loop run with the double-precision reference
+ * conversions below. Timing both in the same run cancels out the speed and load of the host. An optimized x86-64
+ * build measures from_* at x6.2, to_* at x1.4 and getTime at x1.8, within a few percent with twelve copies running
+ * at once. Each floor is half of that: the host has hardware floating point, so the reference is quick, and the
+ * floors catch a conversion that has become several times slower (a loop, or division where a multiply was).
+ */
+#define RATIO_FROM_FLOOR 3.0
+#define RATIO_TO_FLOOR 0.7
+#define RATIO_GETTIME_FLOOR 0.9
+#define BENCH_ROUNDS 3
+
+static volatile uint32_t sink; //keeps the optimizer from discarding the benchmark loops
+
+/**
+ * Splits a nanosecond count into normalized PreciseTime fields in double precision, the way a straightforward
+ * implementation would.
+ */
+static PreciseTime ref_split(double ns) {
+    PreciseTime t;
+    uint32_t *f[NUM_UNITS] = { &t.h, &t.m, &t.s, &t.ms, &t.us, &t.ns };
+    for (uint8_t i = 0; i < NUM_UNITS; i++) {
+        *f[i] = (uint32_t) (ns / (double) ns_per_unit[i]);
+        ns -= *f[i] * (double) ns_per_unit[i];
+    }
+    return t;
+}
+
+/**
+ * Reference for PreciseTime::from_*(), in double precision.
+ */
+template <uint8_t U>
+static PreciseTime ref_from(uint32_t v) {
+    return ref_split((double) v * (double) ns_per_unit[U]);
+}
+
+/**
+ * Reference for PreciseTime::to_*(), in double precision.
+ */
+template <uint8_t W>
+static uint32_t ref_to(PreciseTime t) {
+    double ns = t.h * 3600e9 + t.m * 60e9 + t.s * 1e9 + t.ms * 1e6 + t.us * 1e3 + (double) t.ns;
+    double v = ns / (double) ns_per_unit[W];
+    return v > 4294967295.0 ? 0xFFFFFFFF : (uint32_t) v;
+}
+
+static const from_fn_t ref_from_fn[NUM_UNITS] = {
+    ref_from<0>, ref_from<1>, ref_from<2>, ref_from<3>, ref_from<4>, ref_from<5>
+};
+static const to_fn_t ref_to_fn[NUM_UNITS] = {
+    ref_to<0>, ref_to<1>, ref_to<2>, ref_to<3>, ref_to<4>, ref_to<5>
+};
+
+static double seconds() {
+    return (double) clock() / CLOCKS_PER_SEC;
+}
+
+/**
+ * @param fn the from_*() conversions to time, in unit order
+ * @returns millions of conversions per second, cycling through all units
+ */
+static double bench_from(const from_fn_t *fn) {
+    const uint32_t n = 20000000;
+    uint32_t v = rand32();
+    uint32_t acc = 0;
+    double start = seconds();
+    for (uint32_t i = 0; i < n; i += NUM_UNITS) {
+        for (uint8_t u = 0; u < NUM_UNITS; u++) {
+            PreciseTime t = fn[u](v);
+            acc += t.h + t.m + t.s + t.ms + t.us + t.ns;
+            v = v * 1664525 + 1013904223;
+        }
+    }
+    double elapsed = seconds() - start;
+    sink = acc;
+    return n / elapsed / 1e6;
+}
+
+/**
+ * @param fn the to_*() conversions to time, in unit order
+ * @returns millions of conversions per second, cycling through all units
+ */
+static double bench_to(const to_fn_t *fn) {
+    const uint32_t n = 20000000;
+    PreciseTime t = PreciseTime::from_ns(rand32());
+    uint32_t acc = 0;
+    double start = seconds();
+    for (uint32_t i = 0; i < n; i += NUM_UNITS) {
+        for (uint8_t w = 0; w < NUM_UNITS; w++)
+            acc += fn[w](t);
+        t.ns = acc % 1000;
+        t.s = acc % 60;
+    }
+    double elapsed = seconds() - start;
+    sink = acc;
+    return n / elapsed / 1e6;
+}
+
+/**
+ * @param reference convert the tick count with ref_split() instead of getTime()
+ * @returns millions of tick count conversions per second at 24 MHz
+ */
+static double bench_gettime(bool reference) {
+    const uint32_t n = 5000000;
+    FakeTimer timer(24000000);
+    uint64_t tick = rand64() >> 8;
+    uint32_t acc = 0;
+    double start = seconds();
+    for (uint32_t i = 0; i < n; i++) {
+        timer.setTick(tick);
+        PreciseTime t = reference ? ref_split((double) timer.getTick64() * 1e9 / timer.tickHz()) : timer.getTime();
+        acc += t.h + t.m + t.s + t.ms + t.us + t.ns;
+        tick += 0x9E3779B9;
+    }
+    double elapsed = seconds() - start;
+    sink = acc;
+    return n / elapsed / 1e6;
+}
+
+static void print_stat(const stat_t *st) {
+    printf("%-14s %12llu %10llu %12llu\n", st->name, (unsigned long long) st->checks,
+           (unsigned long long) st->mismatches, (unsigned long long) st->max_error);
+}
+
+/**
+ * Prints a throughput against its reference.
+ * @returns true if mcps is at least floor_ratio times ref_mcps
+ */
+static bool report_rate(const char *name, double mcps, double ref_mcps, double floor_ratio) {
+    bool ok = mcps >= ref_mcps * floor_ratio;
+    printf("%-14s %10.1f M/s   reference %8.1f M/s   x%.2f (floor x%.2f)%s\n", name, mcps, ref_mcps,
+           mcps / ref_mcps, floor_ratio, ok ? "" : "   REGRESSED");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    uint64_t samples = 1000000;
+    bool throughput = true;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc)
+            samples = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            rng_state = strtoull(argv[++i], NULL, 0) | 1; //xorshift state must not be zero
+        else if (strcmp(argv[i], "--no-throughput") == 0)
+            throughput = false; //for debug or instrumented builds
+        else {
+            fprintf(stderr, "Usage: %s [--samples N] [--seed S] [--no-throughput]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    bool ok = true;
+    run_checks(samples);
+
+    printf("%-14s %12s %10s %12s\n", "conversion", "checks", "mismatches", "max error");
+    for (uint8_t u = 0; u < NUM_UNITS; u++)
+        print_stat(&from_stats[u]);
+    for (uint8_t w = 0; w < NUM_UNITS; w++)
+        print_stat(&to_stats[w]);
+    print_stat(&elapsed_stats);
+    print_stat(&gettime_stats);
+    printf("max error is in ns for from_*, getElapsedNs and getTime, otherwise in units of the result\n\n");
+
+    for (uint8_t u = 0; u < NUM_UNITS; u++)
+        ok = ok && from_stats[u].mismatches == 0 && to_stats[u].mismatches == 0;
+    ok = ok && elapsed_stats.mismatches == 0 && gettime_stats.mismatches == 0;
+    ok = check_start() && ok;
+
+    if (throughput) {
+        //Evaluate every benchmark, so that all rates are reported even after a failure
+        //Alternate each conversion with its reference and keep the best of each, so a burst of load on the host
+        //during one loop does not decide the result
+        double rate[3] = { 0, 0, 0 };
+        double ref[3] = { 0, 0, 0 };
+        for (uint8_t k = 0; k < BENCH_ROUNDS; k++) {
+            rate[0] = fmax(rate[0], bench_from(from_fn));
+            ref[0] = fmax(ref[0], bench_from(ref_from_fn));
+            rate[1] = fmax(rate[1], bench_to(to_fn));
+            ref[1] = fmax(ref[1], bench_to(ref_to_fn));
+            rate[2] = fmax(rate[2], bench_gettime(false));
+            ref[2] = fmax(ref[2], bench_gettime(true));
+        }
+        bool fast = report_rate("from_*", rate[0], ref[0], RATIO_FROM_FLOOR);
+        fast = report_rate("to_*", rate[1], ref[1], RATIO_TO_FLOOR) && fast;
+        fast = report_rate("getTime", rate[2], ref[2], RATIO_GETTIME_FLOOR) && fast;
+        ok = ok && fast;
+    }
+
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
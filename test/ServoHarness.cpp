@@ -0,0 +1,246 @@
+/* ServoHarness.cpp
+ * Host-run regression harness for the DisciplinedClock servo. A simulated 1PPS source feeds pulses timestamped on a
+ * fake timer whose oscillator runs off its nominal rate, and the disciplined time is compared with the true time.
+ * Covers convergence from a large frequency error, missed pulses, glitch pulses, and holdover after the pulses stop.
+ * The exit status is non-zero if any check fails.
+ *
+ * Usage: ServoHarness [--seed S]
+ *
+ * Author: HardwareTimer library contributors
+ */
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+#include "DisciplinedClock.h"
+#include "FakeTimer.h"
+
+typedef unsigned __int128 uint128_t;
+
+#define NOMINAL_HZ 48000000
+#define NS_PER_SEC 1000000000ULL
+#define LATENCY_NS 3000 //pulse interrupt latency: the servo runs this long after the edge it was given
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+static uint32_t failures = 0;
+
+/**
+ * xorshift64*: fast and reproducible for a given --seed.
+ */
+static uint64_t rand64() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void check(bool ok, const char *scenario, const char *what, int64_t value, int64_t limit) {
+    printf("  %-4s %-34s %12lld (limit %lld)\n", ok ? "ok" : "FAIL", what, (long long) value, (long long) limit);
+    if (!ok) {
+        fprintf(stderr, "FAIL %s: %s\n", scenario, what);
+        failures++;
+    }
+}
+
+/**
+ * A timer oscillator that runs ppb parts per billion fast, and a PPS source on true whole seconds.
+ */
+typedef struct {
+    const char *name;
+    FakeTimer *timer;
+    DisciplinedClock *clock;
+    int32_t ppb; //oscillator frequency error
+    uint32_t jitter; //pulse edges are spread uniformly over +-jitter ns
+    int64_t label; //disciplined time minus true time, a whole number of seconds fixed at the first pulse
+    uint64_t last; //last disciplined time read, to check that time never runs backwards
+    bool backwards;
+    int64_t worst; //largest error magnitude seen by sim_error(), ns
+} sim_t;
+
+static void sim_init(sim_t *sim, const char *name, int32_t ppb, uint32_t jitter) {
+    sim->name = name;
+    sim->timer = new FakeTimer(NOMINAL_HZ);
+    sim->clock = new DisciplinedClock(sim->timer);
+    sim->ppb = ppb;
+    sim->jitter = jitter;
+    sim->label = 0;
+    sim->last = 0;
+    sim->backwards = false;
+    sim->worst = 0;
+    printf("%s (oscillator %+d ppb, jitter +-%u ns)\n", name, ppb, jitter);
+}
+
+static void sim_free(sim_t *sim) {
+    delete sim->clock;
+    delete sim->timer;
+}
+
+/**
+ * @returns the timer tick at true time t, in ns
+ */
+static uint64_t sim_tick(sim_t *sim, uint64_t t) {
+    return (uint64_t) ((uint128_t) t * NOMINAL_HZ * (uint64_t) ((int64_t) NS_PER_SEC + sim->ppb) / NS_PER_SEC / NS_PER_SEC);
+}
+
+/**
+ * Delivers the pulse of true second k, or a stray pulse at k seconds plus offset ns.
+ */
+static void sim_pulse(sim_t *sim, uint64_t k, int64_t offset) {
+    int64_t jitter = sim->jitter ? (int64_t) (rand64() % (2 * sim->jitter + 1)) - sim->jitter : 0;
+    uint64_t t = k * NS_PER_SEC + offset + jitter;
+    uint64_t edge = sim_tick(sim, t);
+    sim->timer->setTick(sim_tick(sim, t + LATENCY_NS));
+    sim->clock->pulse(edge);
+
+    if (sim->label == 0) { //the first pulse fixes which second the disciplined time calls this one
+        int64_t d = (int64_t) (sim->clock->toNs(edge) - t);
+        sim->label = (d + (int64_t) NS_PER_SEC / 2) / (int64_t) NS_PER_SEC * (int64_t) NS_PER_SEC;
+    }
+}
+
+/**
+ * @returns disciplined time minus true time at true time t, in ns
+ */
+static int64_t sim_error(sim_t *sim, uint64_t t) {
+    sim->timer->setTick(sim_tick(sim, t));
+    uint64_t ns = sim->clock->getNs();
+    if (ns < sim->last)
+        sim->backwards = true;
+    sim->last = ns;
+
+    int64_t err = (int64_t) (ns - t) - sim->label;
+    int64_t mag = err < 0 ? -err : err;
+    if (mag > sim->worst)
+        sim->worst = mag;
+    return err;
+}
+
+/**
+ * Runs pulses first..last, reading the time ten times per second in between.
+ * @param skip_from, skip_to pulses in this range are not delivered
+ */
+static void sim_run(sim_t *sim, uint64_t first, uint64_t last, uint64_t skip_from, uint64_t skip_to) {
+    for (uint64_t k = first; k <= last; k++) {
+        if (k < skip_from || k > skip_to)
+            sim_pulse(sim, k, 0);
+        for (uint64_t i = 1; i < 10; i++)
+            sim_error(sim, k * NS_PER_SEC + LATENCY_NS + i * (NS_PER_SEC / 10));
+    }
+}
+
+static DisciplinedClock::status_t sim_status(sim_t *sim) {
+    DisciplinedClock::status_t s;
+    sim->clock->getStatus(&s);
+    return s;
+}
+
+/**
+ * Locks onto a large frequency error in both directions and holds the phase to within the jitter.
+ */
+static void test_convergence(int32_t ppb) {
+    sim_t sim;
+    sim_init(&sim, "convergence", ppb, 50);
+    sim_run(&sim, 1, 20, 0, 0);
+    DisciplinedClock::status_t s = sim_status(&sim);
+    check(s.state == DisciplinedClock::locked, sim.name, "locked after 20 pulses", s.state, DisciplinedClock::locked);
+
+    sim.worst = 0;
+    sim_run(&sim, 21, 120, 0, 0);
+    s = sim_status(&sim);
+    check(sim.worst <= 500, sim.name, "max |error| once locked, ns", sim.worst, 500);
+    int64_t ferr = (int64_t) s.freq + ppb; //the correction cancels the oscillator error
+    check(ferr >= -100 && ferr <= 100, sim.name, "frequency correction error, ppb", ferr, 100);
+    check(!sim.backwards, sim.name, "time never ran backwards", sim.backwards, 0);
+    sim_free(&sim);
+}
+
+/**
+ * Rides through three missing pulses and counts them.
+ */
+static void test_missed() {
+    sim_t sim;
+    sim_init(&sim, "missed pulses", 20000, 50);
+    sim_run(&sim, 1, 40, 0, 0);
+    sim.worst = 0;
+    sim_run(&sim, 41, 80, 51, 53);
+    DisciplinedClock::status_t s = sim_status(&sim);
+    check(s.missed == 3, sim.name, "missed pulses counted", s.missed, 3);
+    check(s.holdovers == 1, sim.name, "holdovers counted", s.holdovers, 1);
+    check(s.state == DisciplinedClock::locked, sim.name, "still locked", s.state, DisciplinedClock::locked);
+    check(sim.worst <= 1000, sim.name, "max |error| across the gap, ns", sim.worst, 1000);
+    check(!sim.backwards, sim.name, "time never ran backwards", sim.backwards, 0);
+    sim_free(&sim);
+}
+
+/**
+ * Ignores stray pulses less than half a second after a real one.
+ */
+static void test_glitch() {
+    sim_t sim;
+    sim_init(&sim, "glitch pulses", -15000, 50);
+    sim_run(&sim, 1, 40, 0, 0);
+    uint32_t before = sim_status(&sim).pulses;
+    sim.worst = 0;
+    for (uint64_t k = 41; k <= 60; k++) {
+        sim_pulse(&sim, k, 0);
+        if (k % 5 == 0)
+            sim_pulse(&sim, k, 300000000); //300 ms after the real pulse
+        for (uint64_t i = 1; i < 10; i++)
+            sim_error(&sim, k * NS_PER_SEC + LATENCY_NS + i * (NS_PER_SEC / 10));
+    }
+    DisciplinedClock::status_t s = sim_status(&sim);
+    check(s.pulses - before == 20, sim.name, "pulses accepted (4 glitches sent)", s.pulses - before, 20);
+    check(s.state == DisciplinedClock::locked, sim.name, "still locked", s.state, DisciplinedClock::locked);
+    check(sim.worst <= 500, sim.name, "max |error|, ns", sim.worst, 500);
+    sim_free(&sim);
+}
+
+/**
+ * Keeps the frequency correction, and only that, when the pulses stop. The last pulse before the outage is
+ * 40 us off, so a phase correction that wrongly persisted would show up as a large drift.
+ */
+static void test_holdover() {
+    sim_t sim;
+    sim_init(&sim, "holdover", 35000, 50);
+    sim_run(&sim, 1, 60, 0, 0);
+    int64_t start = sim_error(&sim, 61 * NS_PER_SEC);
+    for (uint64_t k = 62; k < 361; k++)
+        sim_error(&sim, k * NS_PER_SEC);
+    int64_t drift = sim_error(&sim, 361 * NS_PER_SEC) - start;
+    DisciplinedClock::status_t s = sim_status(&sim);
+    check(s.state == DisciplinedClock::holdover, sim.name, "in holdover", s.state, DisciplinedClock::holdover);
+    //Without the frequency correction this would be 10.5 ms. What is left is the integral term's response to the
+    //jitter of the last few pulses, some tens of ppb.
+    check(drift >= -20000 && drift <= 20000, sim.name, "drift over 300 s of holdover, ns", drift, 20000);
+
+    //Lock again, then lose the pulses right after a badly timed one
+    sim_run(&sim, 362, 420, 0, 0);
+    sim_pulse(&sim, 421, 40000);
+    start = sim_error(&sim, 422 * NS_PER_SEC);
+    drift = sim_error(&sim, 482 * NS_PER_SEC) - start;
+    //The 0.3 integral gain moves the frequency by 12 ppm, 720 us over 60 s. The 0.7 phase term is 28 us in all,
+    //slewed out in the first second, so it must not add to the drift after that.
+    int64_t limit = 740000;
+    check(drift >= -limit && drift <= limit, sim.name, "drift over 60 s after a 40 us outlier, ns", drift, limit);
+    check(!sim.backwards, sim.name, "time never ran backwards", sim.backwards, 0);
+    sim_free(&sim);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            rng_state = strtoull(argv[++i], NULL, 0) | 1;
+        else {
+            fprintf(stderr, "usage: %s [--seed S]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    test_convergence(50000);
+    test_convergence(-80000);
+    test_missed();
+    test_glitch();
+    test_holdover();
+
+    printf("\n%s: %u check(s) failed\n", failures ? "FAIL" : "PASS", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+/* FakeTimer.h
+ * Host stand-in for a hardware timer, shared by the host harnesses. Its counter reads whatever the harness sets
+ * while it runs, and garbage while it is stopped, like the PIT's.
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef FAKETIMER_H
+#define FAKETIMER_H
+
+#include "mbed.h"
+#include "HardwareTimer.h"
+
+/**
+ * Stands in for a hardware timer. Its tick count is whatever the harness sets.
+ */
+class FakeTimer : public HardwareTimer {
+    public:
+        FakeTimer(uint32_t hz) :
+                HardwareTimer(0xFFFFFFFF, 1.0f / hz, HardwareTimer::s, PIT_IRQn),
+                __hz(hz),
+                __counter(0)
+                {
+            __valid = true;
+            enable((void (*)(void)) NULL); //reads the tick rate from __clock_hz()
+        }
+
+        virtual ~FakeTimer() {
+            disable(); //while __stop_timer() still exists
+        }
+
+        /**
+         * Sets the counter so that getTick64() returns tick.
+         * @param tick the tick count, which must not be below the count at the last restart
+         */
+        void setTick(uint64_t tick) {
+            __counter = tick - __tickBase;
+        }
+
+        virtual uint32_t getTick() {
+            return (uint32_t) getTick64();
+        }
+
+        virtual uint64_t getTick64() {
+            if (__held)
+                return __heldTick;
+            return __tickBase + __counter;
+        }
+
+        virtual void __timer_isr() {}
+
+    private:
+        virtual void __init_timer() { __counter = STOPPED_COUNT; }
+        virtual void __start_timer() { __counter = 0; }
+        virtual void __stop_timer() { __counter = STOPPED_COUNT; }
+        virtual uint32_t __clock_hz() { return __hz; }
+        virtual void __load_period(uint32_t) {}
+
+        const static uint64_t STOPPED_COUNT = 0xFFFFFFFF; //what a stopped PIT reads back as: a whole 32-bit period
+
+        uint32_t __hz;
+        uint64_t __counter; //ticks since the last restart
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+/* mbed.h
+ * Host stand-in for the parts of the mbed SDK used by PreciseTime and HardwareTimer, so that their conversion
+ * code can be built and checked on a PC. There is no hardware: interrupt control does nothing.
+ * Author: HardwareTimer library contributors
+ */
+
+#ifndef HOST_MBED_H
+#define HOST_MBED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+typedef enum {
+    TPM0_IRQn,
+    PIT_IRQn,
+    LPTimer_IRQn
+} IRQn_Type;
+
+inline void NVIC_EnableIRQ(IRQn_Type) {}
+inline void NVIC_DisableIRQ(IRQn_Type) {}
+inline void __disable_irq() {}
+inline void __enable_irq() {}
+inline uint32_t __get_PRIMASK() { return 0; }
+inline void __set_PRIMASK(uint32_t) {}
+inline uint32_t __get_IPSR() { return 0; } //always thread mode
+inline void __DMB() {}
+inline void sleep() {}
+
+inline void error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    exit(1);
+}
+
+/**
+ * Calls a function or a member function. Only what HardwareTimer needs.
+ */
+class FunctionPointer {
+    public:
+        FunctionPointer() : __fptr(NULL), __obj(NULL), __thunk(NULL) {}
+        
+        void attach(void (*fptr)(void)) {
+            __fptr = fptr;
+            __obj = NULL;
+        }
+        
+        template<typename T> void attach(T *tptr, void (T::*mptr)(void)) {
+            __fptr = NULL;
+            __obj = tptr;
+            memcpy(__method, &mptr, sizeof(mptr));
+            __thunk = &FunctionPointer::__call_member<T>;
+        }
+        
+        void call() {
+            if (__fptr != NULL)
+                __fptr();
+            else if (__obj != NULL)
+                __thunk(__obj, __method);
+        }
+        
+    private:
+        template<typename T> static void __call_member(void *obj, char *method) {
+            void (T::*mptr)(void);
+            memcpy(&mptr, method, sizeof(mptr));
+            (static_cast<T *>(obj)->*mptr)();
+        }
+        
+        void (*__fptr)(void);
+        void *__obj;
+        void (*__thunk)(void *, char *);
+        char __method[2 * sizeof(void *)];
+};
+
+#endif